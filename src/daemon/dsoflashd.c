@@ -0,0 +1,382 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "dsoflashd.h"
+#include "../dsoflash.h"
+#include "../md5.h"
+
+struct image_t {
+    FILE *f;
+    uint64_t len;
+    struct UL_MD5Context md5;
+    char digest[33];
+    const char *expect;                         // md5 the image has to match, NULL for any
+};
+
+static struct dsoflash_t *dev;
+static volatile sig_atomic_t quit;
+
+static struct {
+    int blank_check;
+    int sparse_read;
+    uint32_t erase_chunk;
+    int spi_auto;
+    uint32_t spi_hz;                            // 0 for the default clock
+    uint32_t spi_calibrated;                    // Result of the last calibration, 0 for none
+} opt;
+
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
+
+static void progress(void *user, const char *phase, uint64_t done, uint64_t total)
+{
+    FILE *out = user;
+
+    fprintf(out, "progress %s %llu %llu\n", phase, (unsigned long long)done, (unsigned long long)total);
+    fflush(out);
+}
+
+static void reply(FILE *out, int err)
+{
+    if (err != DSOFLASH_OK) {
+        fprintf(out, "error %s\n", dsoflash_strerror(err));
+    } else {
+        fprintf(out, "ok\n");
+    }
+}
+
+static void device_close(void)
+{
+    dsoflash_close(dev);
+    dev = NULL;
+}
+
+static int device_clock(void)
+{
+    uint32_t hz;
+
+    if (opt.spi_auto) {
+        if (dsoflash_calibrate(dev, &hz) != DSOFLASH_OK) {
+            return DSOFLASH_ERR_SPI;
+        }
+        opt.spi_auto = 0;                       // Keep the result for the next opens
+        opt.spi_hz = opt.spi_calibrated = hz;
+    } else if (opt.spi_hz) {
+        dsoflash_spi_clock(dev, opt.spi_hz);
+    }
+    return DSOFLASH_OK;
+}
+
+// Opened once, then kept in HS mode with DDR and flash set up until reset or close
+static int device_open(void)
+{
+    int err;
+
+    if (dev) {
+        return DSOFLASH_OK;
+    }
+    if ((err = dsoflash_open(&dev, NULL)) != DSOFLASH_OK) {
+        dev = NULL;
+        return err;
+    }
+    if ((err = dsoflash_hs_mode(dev)) == DSOFLASH_OK && (err = dsoflash_detect(dev)) == DSOFLASH_OK) {
+        err = device_clock();
+    }
+    if (err != DSOFLASH_OK) {
+        device_close();
+        return err;
+    }
+    printf("Flash found: '%s'  Size: %llu MB\n", dsoflash_name(dev),
+           (unsigned long long)(dsoflash_capacity(dev)/(1024*1024)));
+    return DSOFLASH_OK;
+}
+
+static void image_digest(struct image_t *img)
+{
+    unsigned char d[UL_MD5LENGTH];
+
+    ul_MD5Final(d, &img->md5);
+    for (int i = 0; i < UL_MD5LENGTH; i++) {
+        sprintf(&img->digest[i*2], "%02x", d[i]);
+    }
+}
+
+static int image_sink(void *user, uint64_t offset, const void *buf, uint32_t len)
+{
+    struct image_t *img = user;
+
+    (void)offset;                               // Pages come in order
+    ul_MD5Update(&img->md5, buf, len);
+    return fwrite(buf, len, 1, img->f) == 1;
+}
+
+static int image_source(void *user, uint64_t offset, void *buf, uint32_t len)
+{
+    struct image_t *img = user;
+
+    if (fread(buf, len, 1, img->f) != 1) {
+        return 0;
+    }
+    ul_MD5Update(&img->md5, buf, len);
+    if (offset + len == img->len) {
+        image_digest(img);
+        return !img->expect || !strcmp(img->expect, img->digest);
+    }
+    return 1;
+}
+
+static void cmd_read(FILE *out, const char *path)
+{
+    struct image_t img = { 0 };
+    int err;
+
+    if (!(img.f = fopen(path, "wb"))) {
+        fprintf(out, "error Unable to write to file %s\n", path);
+        return;
+    }
+    ul_MD5Init(&img.md5);
+    err = dsoflash_read(dev, image_sink, &img);
+    if (fclose(img.f) && err == DSOFLASH_OK) {
+        err = DSOFLASH_ERR_IO;
+    }
+    if (err != DSOFLASH_OK) {
+        fprintf(out, "error %s\n", dsoflash_strerror(err));
+        return;
+    }
+    image_digest(&img);
+    fprintf(out, "ok %s\n", img.digest);
+}
+
+static void cmd_write(FILE *out, char *args)
+{
+    struct image_t img = { 0 };
+    char *path = strchr(args, ' ');
+    int err;
+
+    if (!path) {
+        fprintf(out, "error Usage: write <md5|-> <path>\n");
+        return;
+    }
+    *path++ = '\0';
+    img.expect = strcmp(args, "-") ? args : NULL;
+    img.len = dsoflash_capacity(dev);
+
+    if (!(img.f = fopen(path, "rb"))) {
+        fprintf(out, "error Unable to read from file %s\n", path);
+        return;
+    }
+    fseeko(img.f, 0, SEEK_END);
+    if ((uint64_t)ftello(img.f) != img.len) {
+        fprintf(out, "error File doesn't match the flash size\n");
+        fclose(img.f);
+        return;
+    }
+    fseeko(img.f, 0, SEEK_SET);
+    ul_MD5Init(&img.md5);
+    err = dsoflash_write(dev, image_source, &img);
+    fclose(img.f);
+
+    if (err == DSOFLASH_ERR_IO && img.digest[0]) {
+        fprintf(out, "error MD5 mismatch, computed %s\n", img.digest);
+    } else if (err != DSOFLASH_OK) {
+        fprintf(out, "error %s\n", dsoflash_strerror(err));
+    } else {
+        fprintf(out, "ok %s\n", img.digest);
+    }
+}
+
+static void cmd_set(FILE *out, const char *args)
+{
+    char name[32], value[32];
+
+    if (sscanf(args, "%31s %31s", name, value) != 2) {
+        fprintf(out, "error Usage: set <option> <value>\n");
+        return;
+    }
+    if (!strcmp(name, "spi-clock")) {
+        double mhz = strtod(value, NULL);
+        if (!strcmp(value, "cached") && opt.spi_calibrated) {
+            opt.spi_auto = 0;
+            opt.spi_hz = opt.spi_calibrated;
+        } else if (!strcmp(value, "auto") || !strcmp(value, "cached")) {
+            opt.spi_auto = 1;
+            opt.spi_hz = 0;
+        } else if (mhz > 0) {
+            opt.spi_auto = 0;
+            opt.spi_hz = mhz * 1e6;
+        } else {
+            fprintf(out, "error Invalid SPI clock '%s'\n", value);
+            return;
+        }
+        if (dev && device_clock() != DSOFLASH_OK) {
+            fprintf(out, "error SPI clock calibration failed\n");
+            return;
+        }
+    } else if (!strcmp(name, "blank-check")) {
+        opt.blank_check = atoi(value);
+    } else if (!strcmp(name, "sparse-read")) {
+        opt.sparse_read = atoi(value);
+    } else if (!strcmp(name, "erase-chunk")) {
+        opt.erase_chunk = strtoul(value, NULL, 0);
+    } else {
+        fprintf(out, "error Unknown option %s\n", name);
+        return;
+    }
+    fprintf(out, "ok\n");
+}
+
+static void command(FILE *out, char *line)
+{
+    char *args = strchr(line, ' ');
+    int err;
+
+    if (args) {
+        *args++ = '\0';
+    }
+    if (!strcmp(line, "set") && args) {
+        cmd_set(out, args);
+        return;
+    }
+    if (!strcmp(line, "close")) {
+        device_close();
+        reply(out, DSOFLASH_OK);
+        return;
+    }
+    if ((err = device_open()) != DSOFLASH_OK) {
+        reply(out, err);
+        return;
+    }
+    dsoflash_set_blank_check(dev, opt.blank_check);
+    dsoflash_set_sparse_read(dev, opt.sparse_read);
+    dsoflash_set_erase_chunk(dev, opt.erase_chunk);
+    dsoflash_set_progress(dev, progress, out);
+
+    if (!strcmp(line, "ver")) {
+        const struct xfel_ctx_t *ctx = dsoflash_ctx(dev);
+        fprintf(out, "ok %.8s ID=0x%08x(%s) dflag=0x%02x dlength=0x%02x scratchpad=0x%08x\n",
+                ctx->version.magic, ctx->version.id, ctx->chip->name, ctx->version.dflag,
+                ctx->version.dlength, ctx->version.scratchpad);
+    } else if (!strcmp(line, "detect")) {
+        if ((err = dsoflash_detect(dev)) != DSOFLASH_OK) {
+            fprintf(out, "error %s\n", dsoflash_strerror(err));
+        } else {
+            fprintf(out, "ok %s %llu\n", dsoflash_name(dev), (unsigned long long)dsoflash_capacity(dev));
+        }
+    } else if (!strcmp(line, "erase")) {
+        reply(out, dsoflash_erase(dev));
+    } else if (!strcmp(line, "reset")) {
+        err = dsoflash_reset(dev);
+        device_close();                         // It comes back in normal mode
+        reply(out, err);
+    } else if (!strcmp(line, "read") && args) {
+        cmd_read(out, args);
+    } else if (!strcmp(line, "write") && args) {
+        cmd_write(out, args);
+    } else {
+        fprintf(out, "error Unknown command %s\n", line);
+    }
+}
+
+static void serve(int fd)
+{
+    char line[DSOFLASHD_LINE_MAX];
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+
+    if (!in || !out) {
+        printf("Unable to serve client: %s\n", strerror(errno));
+        if (out) {
+            fclose(out);
+        }
+        if (in) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        return;
+    }
+    while (!quit && fgets(line, sizeof (line), in)) {
+        if (!strchr(line, '\n') && !feof(in)) {                // Refused rather than run with a cut path
+            fprintf(out, "error Command too long\n");
+            fflush(out);
+            for (int c = 0; c != EOF && c != '\n'; c = fgetc(in)) {
+            }
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0]) {
+            command(out, line);
+            fflush(out);
+        }
+    }
+    fclose(out);
+    fclose(in);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sigaction sa = { .sa_handler = on_signal };      // No SA_RESTART, so accept() returns on signals
+    int srv, probe;
+
+    if (argc != 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+        printf("Usage: dsoflashd <socket>   - Serve dsoflash --daemon <socket>, see src/daemon/dsoflashd.h\n");
+        return argc != 2;
+    }
+    if (strlen(argv[1]) >= sizeof (addr.sun_path)) {
+        printf("Socket path too long: %s\n", argv[1]);
+        return -1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    if ((srv = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || (probe = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        printf("Unable to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (!connect(probe, (struct sockaddr *)&addr, sizeof (addr))) {
+        printf("dsoflashd is already running on %s\n", argv[1]);
+        return -1;
+    }
+    close(probe);
+    unlink(argv[1]);                                        // Left over by a daemon that didn't exit cleanly
+    if (bind(srv, (struct sockaddr *)&addr, sizeof (addr)) || chmod(argv[1], 0600) || listen(srv, 4)) {
+        printf("Unable to listen on %s: %s\n", argv[1], strerror(errno));
+        close(srv);
+        return -1;
+    }
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);                               // Clients may go away mid answer
+    printf("Listening on %s\n", argv[1]);
+    fflush(stdout);
+
+    while (!quit) {
+        int fd = accept(srv, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                printf("accept: %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        serve(fd);
+        fflush(stdout);
+    }
+
+    device_close();
+    close(srv);
+    unlink(argv[1]);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef DSOFLASHD_H_
+#define DSOFLASHD_H_
+
+#include <limits.h>
+
+/*
+ * dsoflashd keeps the scope open between jobs: after the first command USB
+ * is in HS mode, DDR is set up and the flash detected, so the next ones
+ * start right away. It serves one client at a time on a Unix socket, one
+ * command per line:
+ *
+ *   ver | detect | erase | reset | close
+ *   read <path> | write <md5|-> <path>
+ *   set spi-clock <MHz|auto|cached> | set blank-check <0|1>
+ *   set erase-chunk <blocks> | set sparse-read <0|1>
+ *
+ * Paths are opened by the daemon, so they should be absolute. Each command
+ * is answered by any number of progress lines and then one ok or error line:
+ *
+ *   progress <phase> <done> <total>
+ *   ok [result]
+ *   error <message>
+ *
+ * read and write answer with the md5 of the image; write compares it with
+ * the given md5 ('-' for none) before programming, while the flash erases,
+ * so a mismatch leaves it erased. reset and close drop the device, the next
+ * command opens it again.
+ */
+#define DSOFLASHD_LINE_MAX  (PATH_MAX + 64U)    // write <md5> <path>
+
+#endif // DSOFLASHD_H_
@@ -0,0 +1,362 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <pthread.h>
+
+#include "dsoflash.h"
+#include "spinand.h"
+#include "report.h"
+#include "f1c100s_f1c200s_f1c500s.h"
+
+#define FEL_VID             (0x1f3a)
+#define FEL_PID             (0xefe8)
+#define USB_PORTS_MAX       (8U)                        // USB 3 allows hubs 7 deep
+#define SOURCE_CHUNK        (1024U*1024)
+#define REOPEN_TIMEOUT_MS   (10000U)
+#define REOPEN_POLL_MS      (20U)                       // First poll after the HS switch, doubled up to
+#define REOPEN_POLL_MAX_MS  (250U)                      // this: it usually is back within a few hundred ms
+
+struct dsoflash_t {
+    struct xfel_ctx_t ctx;
+    char name[128];
+    uint64_t capacity;                                  // 0 until detected
+    uint32_t pages;
+    struct spinand_opts_t opts;
+    uint32_t ecc_len;
+};
+
+struct dsoflash_buf_t {
+    uint8_t *buf;
+    uint64_t len;
+};
+
+struct dsoflash_sink_ctx_t {
+    dsoflash_sink_t sink;
+    void *user;
+    int failed;
+};
+
+struct dsoflash_pull_t {
+    dsoflash_source_t source;
+    void *user;
+    uint8_t *buf;
+    uint64_t len;
+    int ok;
+};
+
+
+const char * dsoflash_strerror(int err)
+{
+    switch (err) {
+    case DSOFLASH_OK:           return "OK";
+    case DSOFLASH_ERR_USB:      return "No FEL device found";
+    case DSOFLASH_ERR_FEL:      return "Device doesn't answer FEL";
+    case DSOFLASH_ERR_FLASH:    return "Unknown flash memory";
+    case DSOFLASH_ERR_NOMEM:    return "Out of memory";
+    case DSOFLASH_ERR_IO:       return "Reading or storing the image failed";
+    case DSOFLASH_ERR_SIZE:     return "Image doesn't match the flash size";
+    case DSOFLASH_ERR_SPI:      return "SPI flash operation failed";
+    case DSOFLASH_ERR_STATE:    return "Flash not detected";
+    default:                    return "Unknown error";
+    }
+}
+
+int dsoflash_open(struct dsoflash_t **dev, libusb_device_handle *hdl)
+{
+    struct dsoflash_t *d = calloc(1, sizeof (*d));
+
+    if (!d) {
+        return DSOFLASH_ERR_NOMEM;
+    }
+    libusb_init(NULL);                                  // The default context counts its users
+    d->ctx.hdl = hdl ? hdl : libusb_open_device_with_vid_pid(NULL, FEL_VID, FEL_PID);
+    if (!d->ctx.hdl) {
+        libusb_exit(NULL);
+        free(d);
+        return DSOFLASH_ERR_USB;
+    }
+    if (!fel_init(&d->ctx)) {
+        libusb_close(d->ctx.hdl);
+        libusb_exit(NULL);
+        free(d);
+        return DSOFLASH_ERR_FEL;
+    }
+    *dev = d;
+    return DSOFLASH_OK;
+}
+
+void dsoflash_close(struct dsoflash_t *dev)
+{
+    if (!dev) {
+        return;
+    }
+    spinand_release(&dev->ctx);
+    f1c100s_release(&dev->ctx);
+    if (dev->ctx.hdl) {
+        libusb_close(dev->ctx.hdl);
+    }
+    libusb_exit(NULL);
+    free(dev);
+}
+
+struct xfel_ctx_t * dsoflash_ctx(struct dsoflash_t *dev)
+{
+    return &dev->ctx;
+}
+
+// The same device after it re-enumerated: same bus and port path, new address
+static libusb_device_handle * usb_reopen(uint8_t bus, uint8_t addr, const uint8_t *ports, int nports)
+{
+    libusb_device_handle *hdl = NULL;
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(NULL, &list);
+
+    for (ssize_t i = 0; i < n && !hdl; i++) {
+        struct libusb_device_descriptor desc;
+        uint8_t p[USB_PORTS_MAX];
+        int np = libusb_get_port_numbers(list[i], p, sizeof (p));
+
+        if (libusb_get_device_descriptor(list[i], &desc) || desc.idVendor != FEL_VID || desc.idProduct != FEL_PID
+            || libusb_get_bus_number(list[i]) != bus || libusb_get_device_address(list[i]) == addr
+            || np != nports || memcmp(p, ports, np)) {
+            continue;
+        }
+        if (libusb_open(list[i], &hdl)) {
+            hdl = NULL;
+        }
+    }
+    if (n >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    return hdl;
+}
+
+int dsoflash_hs_mode(struct dsoflash_t *dev)
+{
+    libusb_device *udev = libusb_get_device(dev->ctx.hdl);
+    uint8_t bus = libusb_get_bus_number(udev), addr = libusb_get_device_address(udev), ports[USB_PORTS_MAX];
+    int nports = libusb_get_port_numbers(udev, ports, sizeof (ports));
+    uint32_t waited = 0, poll = REOPEN_POLL_MS, tries = 0;
+
+    if (libusb_get_device_speed(udev) >= LIBUSB_SPEED_HIGH) {
+        return DSOFLASH_OK;                                                 // Switched by an earlier run
+    }
+
+    fel_write32(&dev->ctx, 0x01c13040, 0x29860);
+    libusb_close(dev->ctx.hdl);                                             // Close USB
+    dev->ctx.hdl = NULL;
+
+    while (waited < REOPEN_TIMEOUT_MS) {
+        usleep(poll * 1000);                                                // Wait for USB reenumeration
+        waited += poll;
+        poll = (2*poll < REOPEN_POLL_MAX_MS) ? 2*poll : REOPEN_POLL_MAX_MS;
+
+        dev->ctx.hdl = usb_reopen(bus, addr, ports, nports);
+        if (dev->ctx.hdl) {
+            if (fel_init(&dev->ctx)) {
+                return DSOFLASH_OK;
+            }
+            libusb_close(dev->ctx.hdl);                                     // Otherwise close handler and retry
+            dev->ctx.hdl = NULL;
+        }
+        report_retry("usb-reopen", ++tries);
+    }
+    return DSOFLASH_ERR_USB;
+}
+
+int dsoflash_detect(struct dsoflash_t *dev)
+{
+    const struct spinand_info_t *info;
+
+    if (!spinand_detect(&dev->ctx, dev->name, &dev->capacity) || !(info = spinand_info_find(dev->name))) {
+        dev->capacity = 0;
+        return DSOFLASH_ERR_FLASH;
+    }
+    dev->pages = dev->capacity / info->page_size;
+    return DSOFLASH_OK;
+}
+
+const char * dsoflash_name(const struct dsoflash_t *dev)
+{
+    return dev->name;
+}
+
+uint64_t dsoflash_capacity(const struct dsoflash_t *dev)
+{
+    return dev->capacity;
+}
+
+uint32_t dsoflash_pages(const struct dsoflash_t *dev)
+{
+    return dev->capacity ? dev->pages : 0;
+}
+
+uint32_t dsoflash_spi_clock(struct dsoflash_t *dev, uint32_t hz)
+{
+    return f1c100s_spi_clock_set(&dev->ctx, hz);
+}
+
+int dsoflash_calibrate(struct dsoflash_t *dev, uint32_t *hz)
+{
+    return spinand_calibrate_clock(&dev->ctx, hz) ? DSOFLASH_OK : DSOFLASH_ERR_SPI;
+}
+
+void dsoflash_set_erase_chunk(struct dsoflash_t *dev, uint32_t blocks)
+{
+    dev->opts.erase_chunk = blocks;
+}
+
+void dsoflash_set_blank_check(struct dsoflash_t *dev, int on)
+{
+    dev->opts.blank_check = on;
+}
+
+void dsoflash_set_sparse_read(struct dsoflash_t *dev, int on)
+{
+    dev->opts.sparse_read = on;
+}
+
+void dsoflash_set_ecc_capture(struct dsoflash_t *dev, uint8_t *status, uint32_t len)
+{
+    dev->opts.ecc = status;
+    dev->ecc_len = len;
+}
+
+void dsoflash_set_progress(struct dsoflash_t *dev, dsoflash_progress_t fn, void *user)
+{
+    dev->opts.progress = fn;
+    dev->opts.user = user;
+}
+
+int dsoflash_erase(struct dsoflash_t *dev)
+{
+    return dso2d_erase(&dev->ctx, &dev->opts) ? DSOFLASH_OK : DSOFLASH_ERR_SPI;
+}
+
+int dsoflash_health(struct dsoflash_t *dev, uint8_t *status, uint32_t len)
+{
+    if (!dev->capacity) {
+        return DSOFLASH_ERR_STATE;
+    }
+    if (len != dev->pages) {
+        return DSOFLASH_ERR_SIZE;
+    }
+    return dso2d_health(&dev->ctx, &dev->opts, status, len) ? DSOFLASH_OK : DSOFLASH_ERR_SPI;
+}
+
+static int sink_call(void *user, uint64_t offset, const void *buf, uint32_t len)
+{
+    struct dsoflash_sink_ctx_t *c = user;
+
+    if (!c->sink(c->user, offset, buf, len)) {
+        c->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int dsoflash_read(struct dsoflash_t *dev, dsoflash_sink_t sink, void *user)
+{
+    struct dsoflash_sink_ctx_t c = { sink, user, 0 };
+
+    if (!dev->capacity) {
+        return DSOFLASH_ERR_STATE;
+    }
+    if (dev->opts.ecc && dev->ecc_len != dev->pages) {
+        return DSOFLASH_ERR_SIZE;
+    }
+    if (!dso2d_dump(&dev->ctx, &dev->opts, sink_call, &c)) {
+        return c.failed ? DSOFLASH_ERR_IO : DSOFLASH_ERR_SPI;
+    }
+    return DSOFLASH_OK;
+}
+
+static int sink_buf(void *user, uint64_t offset, const void *buf, uint32_t len)
+{
+    struct dsoflash_buf_t *b = user;
+
+    if (offset > b->len || len > b->len - offset) {
+        return 0;
+    }
+    memcpy(b->buf + offset, buf, len);
+    return 1;
+}
+
+int dsoflash_read_buf(struct dsoflash_t *dev, void *buf, uint64_t len)
+{
+    struct dsoflash_buf_t b = { buf, len };
+
+    if (dev->capacity && len != dev->capacity) {
+        return DSOFLASH_ERR_SIZE;
+    }
+    return dsoflash_read(dev, sink_buf, &b);
+}
+
+static void *source_pull(void *arg)
+{
+    struct dsoflash_pull_t *p = arg;
+
+    p->ok = 1;
+    for (uint64_t off = 0; p->ok && off < p->len; off += SOURCE_CHUNK) {
+        uint32_t n = (p->len - off) < SOURCE_CHUNK ? (p->len - off) : SOURCE_CHUNK;
+        p->ok = p->source(p->user, off, p->buf + off, n);
+    }
+    return NULL;
+}
+
+int dsoflash_write(struct dsoflash_t *dev, dsoflash_source_t source, void *user)
+{
+    struct dsoflash_pull_t p = { source, user, NULL, dev->capacity, 0 };
+    pthread_t puller;
+    int threaded, ret;
+
+    if (!dev->capacity) {
+        return DSOFLASH_ERR_STATE;
+    }
+    if (!(p.buf = malloc(dev->capacity))) {
+        return DSOFLASH_ERR_NOMEM;
+    }
+    threaded = !pthread_create(&puller, NULL, source_pull, &p);     // Image comes in while the flash erases
+    if (!threaded) {
+        source_pull(&p);
+    }
+    ret = (threaded || p.ok) ? dsoflash_erase(dev) : DSOFLASH_OK;
+    if (threaded) {
+        pthread_join(puller, NULL);
+    }
+    if (!p.ok) {
+        ret = DSOFLASH_ERR_IO;
+    } else if (ret == DSOFLASH_OK) {
+        ret = dsoflash_program_buf(dev, p.buf, dev->capacity);
+    }
+    free(p.buf);
+    return ret;
+}
+
+int dsoflash_write_buf(struct dsoflash_t *dev, const void *buf, uint64_t len)
+{
+    if (!dev->capacity) {
+        return DSOFLASH_ERR_STATE;
+    }
+    if (len != dev->capacity) {
+        return DSOFLASH_ERR_SIZE;
+    }
+    return dso2d_restore(&dev->ctx, &dev->opts, buf) ? DSOFLASH_OK : DSOFLASH_ERR_SPI;
+}
+
+int dsoflash_program_buf(struct dsoflash_t *dev, const void *buf, uint64_t len)
+{
+    if (!dev->capacity) {
+        return DSOFLASH_ERR_STATE;
+    }
+    if (len != dev->capacity) {
+        return DSOFLASH_ERR_SIZE;
+    }
+    return dso2d_program(&dev->ctx, &dev->opts, buf) ? DSOFLASH_OK : DSOFLASH_ERR_SPI;
+}
+
+int dsoflash_reset(struct dsoflash_t *dev)
+{
+    return fel_chip_reset(&dev->ctx) ? DSOFLASH_OK : DSOFLASH_ERR_FEL;
+}
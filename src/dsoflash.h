@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef DSOFLASH_H_
+#define DSOFLASH_H_
+
+#include <fel.h>
+
+/*
+ * libdsoflash: the flasher behind an opaque per-device handle, so one
+ * process can drive several scopes at once, each from its own thread.
+ *
+ * Calls return DSOFLASH_OK or a negative DSOFLASH_ERR_*, nothing exits
+ * except xfel itself on a failed USB transfer. Data comes from and goes
+ * to caller callbacks, or a buffer. Traces, stats and JSON lines progress
+ * (trace.h, stats.h, report.h) stay process wide and follow one device.
+ *
+ * The library also writes to stdout with printf(): a line as each phase
+ * starts, the calibration steps, and the cause of an error before its
+ * DSOFLASH_ERR_* is returned. Nothing tells which handle a line came from,
+ * so with several devices busy at once their lines interleave.
+ */
+struct dsoflash_t;
+
+enum {
+    DSOFLASH_OK             =  0,
+    DSOFLASH_ERR_USB        = -1,   // No FEL device, or it didn't come back
+    DSOFLASH_ERR_FEL        = -2,   // Device doesn't answer FEL
+    DSOFLASH_ERR_FLASH      = -3,   // No known SPI NAND
+    DSOFLASH_ERR_NOMEM      = -4,
+    DSOFLASH_ERR_IO         = -5,   // Source or sink failed
+    DSOFLASH_ERR_SIZE       = -6,   // Image doesn't match the flash
+    DSOFLASH_ERR_SPI        = -7,   // SPI command stream failed or timed out
+    DSOFLASH_ERR_STATE      = -8,   // Flash not detected yet
+};
+
+// Fill/take len bytes at offset of the flash image; return 0 to abort
+typedef int (*dsoflash_source_t)(void *user, uint64_t offset, void *buf, uint32_t len);
+typedef int (*dsoflash_sink_t)(void *user, uint64_t offset, const void *buf, uint32_t len);
+typedef void (*dsoflash_progress_t)(void *user, const char *phase, uint64_t done, uint64_t total);
+
+const char * dsoflash_strerror(int err);
+
+// hdl NULL opens the first FEL device, otherwise the handle is taken over
+int dsoflash_open(struct dsoflash_t **dev, libusb_device_handle *hdl);
+void dsoflash_close(struct dsoflash_t *dev);
+struct xfel_ctx_t * dsoflash_ctx(struct dsoflash_t *dev);
+
+// Switch USB to high speed unless it already is, and reopen it once it re-enumerated
+int dsoflash_hs_mode(struct dsoflash_t *dev);
+int dsoflash_detect(struct dsoflash_t *dev);
+const char * dsoflash_name(const struct dsoflash_t *dev);
+uint64_t dsoflash_capacity(const struct dsoflash_t *dev);
+uint32_t dsoflash_pages(const struct dsoflash_t *dev);
+
+uint32_t dsoflash_spi_clock(struct dsoflash_t *dev, uint32_t hz);
+int dsoflash_calibrate(struct dsoflash_t *dev, uint32_t *hz);
+void dsoflash_set_erase_chunk(struct dsoflash_t *dev, uint32_t blocks);
+void dsoflash_set_blank_check(struct dsoflash_t *dev, int on);
+// Reads leave pages of 0xFF on the device (checked there), the sink still gets them
+void dsoflash_set_sparse_read(struct dsoflash_t *dev, int on);
+// Reads also store Status-3 of every page (ECCS1:0 in bits 5:4) in status, len dsoflash_pages(); NULL to stop
+void dsoflash_set_ecc_capture(struct dsoflash_t *dev, uint8_t *status, uint32_t len);
+void dsoflash_set_progress(struct dsoflash_t *dev, dsoflash_progress_t fn, void *user);
+
+/*
+ * Writing skips empty pages and gathers batches ahead of the device, so the
+ * whole image is pulled from the source before programming starts. The
+ * source runs on a thread of its own meanwhile and the flash is erased: a
+ * source giving up leaves it erased, but not programmed.
+ */
+int dsoflash_erase(struct dsoflash_t *dev);
+// Status-3 of every page after loading it, ECCS1:0 in bits 5:4; len is dsoflash_pages()
+int dsoflash_health(struct dsoflash_t *dev, uint8_t *status, uint32_t len);
+int dsoflash_read(struct dsoflash_t *dev, dsoflash_sink_t sink, void *user);
+int dsoflash_read_buf(struct dsoflash_t *dev, void *buf, uint64_t len);
+int dsoflash_write(struct dsoflash_t *dev, dsoflash_source_t source, void *user);
+int dsoflash_write_buf(struct dsoflash_t *dev, const void *buf, uint64_t len);
+// dsoflash_write_buf() on a flash dsoflash_erase() left empty
+int dsoflash_program_buf(struct dsoflash_t *dev, const void *buf, uint64_t len);
+int dsoflash_reset(struct dsoflash_t *dev);
+
+#endif // DSOFLASH_H_
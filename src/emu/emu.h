@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef EMU_H_
+#define EMU_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../spinand.h"
+
+struct emu_timing {
+    uint64_t usb_latency_ns;        // Per bulk transfer
+    uint64_t usb_byte_ps;           // Per byte on the bus
+    uint64_t exec_ns;               // FEL exec round trip on top of the transfers
+    uint64_t t_rd_ns;
+    uint64_t t_prog_ns;
+    uint64_t t_bers_ns;
+};
+
+struct emu_stats {
+    uint64_t now_ns;                // Virtual time
+    uint64_t usb_ns;
+    uint64_t spi_ns;
+    uint64_t wait_ns;
+    uint64_t usb_out;
+    uint64_t usb_in;
+    uint64_t usb_transfers;
+    uint64_t execs;
+    uint64_t loops;
+    uint64_t page_reads;
+    uint64_t page_programs;
+    uint64_t block_erases;
+    uint64_t violations;
+};
+
+extern struct emu_timing emu_timing;
+extern struct emu_stats emu_stats;
+
+// Device memory, NULL for anything outside SRAM/SDRAM
+uint8_t * emu_mem(uint32_t addr, uint32_t len);
+
+int emu_nand_init(const char *chip, const char *flash_file, const char *ecc_faults);
+void emu_nand_exit(void);
+void emu_spi_run(uint32_t cbuf);
+
+#endif // EMU_H_
@@ -0,0 +1,493 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ *
+ * SPI command stream interpreter (mirrors the F1C100s SPI payload) driving
+ * a simulated SPI NAND with per-die busy timing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../f1c100s_f1c200s_f1c500s.h"
+#include "emu.h"
+
+#define SPI_PAYLOAD_CCR     (0x00008800UL + 0x4b0)
+#define MAX_DIES            (2U)
+#define MAX_ECC_FAULTS      (64U)
+
+enum {
+    STATUS_OIP      = 1U << 0,
+    STATUS_WEL      = 1U << 1,
+    STATUS_E_FAIL   = 1U << 2,
+    STATUS_P_FAIL   = 1U << 3,
+    STATUS_ECCS     = 3U << 4,
+};
+
+struct die {
+    uint8_t *array;
+    uint8_t *cache;
+    uint8_t protect;
+    uint8_t config;
+    uint8_t status;
+    uint64_t busy_until;
+};
+
+static struct spinand_info_t geo;
+static struct die dies[MAX_DIES];
+static uint32_t die_sel;
+static uint32_t raw_page;                               // Data + spare
+static uint64_t byte_ns = 160;                          // 50 MHz
+static const char *flash_path;
+static struct {
+    uint32_t page;                                      // Die major, as in the image
+    uint8_t eccs;
+} ecc_faults[MAX_ECC_FAULTS];
+static uint32_t ecc_nfaults;
+
+static struct {
+    int active;
+    uint8_t hdr[8];
+    uint32_t len;                                       // Bytes clocked since select
+    uint32_t col;
+} cs;
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void violation(const char *what)
+{
+    if (emu_stats.violations++ < 10) {
+        fprintf(stderr, "emu: protocol violation: %s (cmd 0x%02x, die %u)\n", what, cs.hdr[0], die_sel);
+    }
+}
+
+static int busy(const struct die *d)
+{
+    return emu_stats.now_ns < d->busy_until;
+}
+
+static uint32_t die_pages(void)
+{
+    return geo.pages_per_block * geo.blocks_per_die;
+}
+
+static uint32_t row_addr(void)
+{
+    uint32_t row = (cs.hdr[1] << 16) | (cs.hdr[2] << 8) | cs.hdr[3];
+    if (row >= die_pages()) {
+        violation("row address out of range");
+        row %= die_pages();
+    }
+    return row;
+}
+
+// ECC outcome a page read reports, from DSOFLASH_EMU_ECC
+static uint8_t ecc_status(const struct die *d, uint32_t row)
+{
+    uint32_t page = (uint32_t)(d - dies)*die_pages() + row;
+
+    for (uint32_t i = 0; i < ecc_nfaults; i++) {
+        if (ecc_faults[i].page == page) {
+            return ecc_faults[i].eccs << 4;
+        }
+    }
+    return 0;
+}
+
+static void spi_time(uint32_t bytes)
+{
+    emu_stats.spi_ns += bytes * byte_ns;
+    emu_stats.now_ns += bytes * byte_ns;
+}
+
+static void cs_select(void)
+{
+    memset(&cs, 0, sizeof (cs));
+    cs.active = 1;
+}
+
+static void cs_tx(uint8_t b)
+{
+    struct die *d = &dies[die_sel];
+
+    if (cs.len < sizeof (cs.hdr)) {
+        cs.hdr[cs.len] = b;
+    }
+    cs.len++;
+
+    switch (cs.hdr[0]) {
+    case 0x02:                                          // PROGRAM_LOAD
+    case 0x84:                                          // PROGRAM_LOAD_RANDOM
+        if (cs.len == 1 && busy(d)) {
+            violation("program load while busy");
+        }
+        if (cs.len == 1 && cs.hdr[0] == 0x02) {
+            memset(d->cache, 0xFF, raw_page);
+        }
+        if (cs.len == 3) {
+            cs.col = ((cs.hdr[1] << 8) | cs.hdr[2]) & 0x1FFF;
+        }
+        if (cs.len > 3) {
+            if (cs.col < raw_page) {
+                d->cache[cs.col] = b;
+            }
+            cs.col++;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static uint8_t cs_rx(void)
+{
+    struct die *d = &dies[die_sel];
+    uint32_t pos = cs.len++;
+
+    switch (cs.hdr[0]) {
+    case 0x9f:                                          // RDID, one address/dummy byte
+        return (pos >= 2 && pos - 2 < geo.id.len) ? geo.id.val[pos - 2] : 0x00;
+    case 0x0f:                                          // GET_FEATURE
+        switch (cs.hdr[1]) {
+        case 0xa0:
+            return d->protect;
+        case 0xb0:
+            return d->config;
+        case 0xc0:
+            return busy(d) ? (d->status | STATUS_OIP) : (d->status & ~STATUS_OIP);
+        case 0xd0:
+            return die_sel << 6;
+        default:
+            return 0x00;
+        }
+    case 0x03:                                          // READ_PAGE_FROM_CACHE
+    case 0x0b:
+        if (pos < 4) {
+            return 0xFF;
+        }
+        if (pos == 4) {
+            cs.col = ((cs.hdr[1] << 8) | cs.hdr[2]) & 0x1FFF;
+        }
+        if (busy(d)) {
+            violation("cache read while busy");
+        }
+        return cs.col < raw_page ? d->cache[cs.col++] : 0xFF;
+    default:
+        return 0xFF;
+    }
+}
+
+static void cs_deselect(void)
+{
+    struct die *d = &dies[die_sel];
+    uint32_t row;
+
+    if (!cs.active) {
+        return;
+    }
+    cs.active = 0;
+
+    switch (cs.hdr[0]) {
+    case 0x06:                                          // WRITE_ENABLE
+        d->status |= STATUS_WEL;
+        break;
+    case 0x04:                                          // WRITE_DISABLE
+        d->status &= ~STATUS_WEL;
+        break;
+    case 0x1f:                                          // SET_FEATURE
+        if (cs.hdr[1] == 0xa0) {
+            d->protect = cs.hdr[2];
+        } else if (cs.hdr[1] == 0xb0) {
+            d->config = cs.hdr[2];
+        } else if (cs.hdr[1] == 0xd0 && geo.ndies > 1) {
+            die_sel = (cs.hdr[2] >> 6) & 1;
+        }
+        break;
+    case 0xc2:                                          // DIE_SELECT
+        if (cs.hdr[1] < geo.ndies) {
+            die_sel = cs.hdr[1];
+        } else {
+            violation("bad die");
+        }
+        break;
+    case 0xff:                                          // RESET
+        d->status = 0;
+        d->busy_until = emu_stats.now_ns + 500000;
+        break;
+    case 0x13:                                          // READ_PAGE_TO_CACHE
+        if (busy(d)) {
+            violation("page read while busy");
+        }
+        row = row_addr();
+        memcpy(d->cache, &d->array[(size_t)row*raw_page], raw_page);
+        d->status = (d->status & ~STATUS_ECCS) | ecc_status(d, row);
+        d->busy_until = emu_stats.now_ns + emu_timing.t_rd_ns;
+        emu_stats.page_reads++;
+        break;
+    case 0x10:                                          // PROGRAM_EXEC
+        if (busy(d)) {
+            violation("program while busy");
+        }
+        row = row_addr();
+        if (!(d->status & STATUS_WEL) || d->protect) {
+            d->status |= STATUS_P_FAIL;
+            violation("program without write enable or protected");
+            break;
+        }
+        for (uint32_t i = 0; i < raw_page; i++) {
+            if (d->array[(size_t)row*raw_page + i] != 0xFF) {
+                violation("program of a page not erased");
+                break;
+            }
+        }
+        for (uint32_t i = 0; i < raw_page; i++) {
+            d->array[(size_t)row*raw_page + i] &= d->cache[i];
+        }
+        d->status &= ~(STATUS_WEL | STATUS_P_FAIL);
+        d->busy_until = emu_stats.now_ns + emu_timing.t_prog_ns;
+        emu_stats.page_programs++;
+        break;
+    case 0xd8:                                          // BLOCK_ERASE
+        if (busy(d)) {
+            violation("erase while busy");
+        }
+        row = row_addr();
+        if (!(d->status & STATUS_WEL) || d->protect) {
+            d->status |= STATUS_E_FAIL;
+            violation("erase without write enable or protected");
+            break;
+        }
+        row -= row % geo.pages_per_block;
+        memset(&d->array[(size_t)row*raw_page], 0xFF, (size_t)geo.pages_per_block*raw_page);
+        d->status &= ~(STATUS_WEL | STATUS_E_FAIL);
+        d->busy_until = emu_stats.now_ns + emu_timing.t_bers_ns;
+        emu_stats.block_erases++;
+        break;
+    default:
+        break;
+    }
+}
+
+static void spi_write(const uint8_t *buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        cs_tx(buf ? buf[i] : 0xFF);
+    }
+    spi_time(len);
+}
+
+static void spi_read(uint8_t *buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t b = cs_rx();
+        if (buf) {
+            buf[i] = b;
+        }
+    }
+    spi_time(len);
+}
+
+static void spinand_wait(void)
+{
+    struct die *d = &dies[die_sel];
+    static const uint8_t tx[2] = { 0x0f, 0xc0 };
+
+    spi_write(tx, 2);
+    spi_read(NULL, 1);
+    if (busy(d)) {                                      // Poll until ready, in 3 byte steps
+        uint64_t wait = d->busy_until - emu_stats.now_ns;
+        uint64_t step = 3 * byte_ns;
+        wait = ((wait + step - 1) / step) * step;
+        emu_stats.wait_ns += wait;
+        emu_stats.now_ns += wait;
+    }
+}
+
+static void spinor_wait(void)
+{
+    static const uint8_t tx[1] = { 0x05 };
+    spi_write(tx, 1);
+    spi_read(NULL, 1);
+}
+
+static void spi_init(void)
+{
+    const uint8_t *ccr = emu_mem(SPI_PAYLOAD_CCR, 4);
+    uint32_t div = ccr ? (le32(ccr) & 0xFF) : 1;
+    byte_ns = (8ULL * 2 * (div + 1) * 1000000000ULL) / F1C100S_AHB_CLK;
+}
+
+// Add stride*mul to every loop field, as the payload does between passes
+static void loop_patch(uint8_t *fields, uint32_t nfields, uint8_t *body, uint32_t mul)
+{
+    for (uint32_t f = 0; f < nfields; f++) {
+        uint8_t *e = &fields[f*7];
+        uint8_t *v = body + (e[0] | (e[1] << 8));
+        uint32_t width = e[2] & 7;
+        uint32_t delta = le32(e + 3) * mul;
+        int step = (e[2] & 0x80) ? -1 : 1;
+        uint32_t carry = 0;
+
+        if (step < 0) {
+            v += width - 1;
+        }
+        for (uint32_t i = 0; i < width; i++, v += step) {
+            uint32_t sum = *v + (delta & 0xFF) + carry;
+            *v = sum & 0xFF;
+            carry = sum >> 8;
+            delta >>= 8;
+        }
+    }
+}
+
+void emu_spi_run(uint32_t cbuf)
+{
+    uint8_t *p = emu_mem(cbuf, 1);
+    struct {
+        uint32_t remaining, count, nfields;
+        uint8_t *fields, *body;
+    } loop = { 0 };
+
+    while (p) {
+        switch (*p++) {
+        case SPI_CMD_INIT:
+            spi_init();
+            break;
+        case SPI_CMD_SELECT:
+            cs_select();
+            break;
+        case SPI_CMD_DESELECT:
+            cs_deselect();
+            break;
+        case SPI_CMD_FAST:
+            spi_write(p + 1, p[0]);
+            p += p[0] + 1;
+            break;
+        case SPI_CMD_TXBUF:
+            spi_write(emu_mem(le32(p), le32(p + 4)), le32(p + 4));
+            p += 8;
+            break;
+        case SPI_CMD_RXBUF:
+            spi_read(emu_mem(le32(p), le32(p + 4)), le32(p + 4));
+            p += 8;
+            break;
+        case SPI_CMD_SPINOR_WAIT:
+            spinor_wait();
+            break;
+        case SPI_CMD_SPINAND_WAIT:
+            spinand_wait();
+            break;
+        case SPI_CMD_LOOP:
+            loop.remaining = loop.count = le32(p);
+            if (!loop.count) {
+                return;
+            }
+            loop.nfields = p[4];
+            loop.fields = p + 5;
+            loop.body = p + 5 + 7*loop.nfields;
+            p = loop.body;
+            emu_stats.loops++;
+            break;
+        case SPI_CMD_NEXT:
+            if (--loop.remaining) {
+                loop_patch(loop.fields, loop.nfields, loop.body, 1);
+                p = loop.body;
+            } else {
+                loop_patch(loop.fields, loop.nfields, loop.body, 1 - loop.count);
+            }
+            break;
+        case SPI_CMD_CHECKFF: {
+            const uint8_t *d = emu_mem(le32(p), le32(p + 4));
+            uint8_t *r = emu_mem(le32(p + 8), 1);
+            uint8_t v = 0xFF;
+            for (uint32_t i = 0; d && i < le32(p + 4); i++) {
+                v &= d[i];
+            }
+            if (r) {
+                *r &= v;
+            }
+            emu_stats.now_ns += le32(p + 4) / 4 * 25;   // One uncached word load and a few ops per word
+            p += 12;
+            break;
+        }
+        default:                                        // SPI_CMD_END and anything unknown
+            return;
+        }
+    }
+}
+
+// "page:eccs,page:eccs..." with the ECCS1:0 value a read of the page reports
+static void ecc_faults_parse(const char *list)
+{
+    char *end;
+
+    for (ecc_nfaults = 0; list && *list && ecc_nfaults < MAX_ECC_FAULTS; ) {
+        ecc_faults[ecc_nfaults].page = strtoul(list, &end, 0);
+        if (*end != ':') {
+            fprintf(stderr, "emu: bad ECC fault list at '%s'\n", list);
+            return;
+        }
+        ecc_faults[ecc_nfaults++].eccs = strtoul(end + 1, &end, 0) & 3;
+        list = (*end == ',') ? end + 1 : end;
+    }
+}
+
+int emu_nand_init(const char *chip, const char *flash_file, const char *ecc_faults_list)
+{
+    const struct spinand_info_t *info = spinand_info_find(chip);
+
+    if (!info || info->ndies > MAX_DIES) {
+        fprintf(stderr, "emu: unknown flash '%s'\n", chip);
+        return 0;
+    }
+    geo = *info;
+
+    raw_page = geo.page_size + geo.spare_size;
+    size_t die_size = (size_t)die_pages() * raw_page;
+
+    for (uint32_t i = 0; i < geo.ndies; i++) {
+        dies[i].array = malloc(die_size);
+        dies[i].cache = malloc(raw_page);
+        if (!dies[i].array || !dies[i].cache) {
+            return 0;
+        }
+        memset(dies[i].array, 0xFF, die_size);
+        memset(dies[i].cache, 0xFF, raw_page);
+        dies[i].protect = 0x7c;                         // Power-up default: all blocks locked
+        dies[i].config = 0x18;
+    }
+
+    ecc_faults_parse(ecc_faults_list);
+    flash_path = flash_file;
+    FILE *f = flash_path ? fopen(flash_path, "rb") : NULL;
+    if (f) {
+        for (uint32_t i = 0; i < geo.ndies; i++) {
+            if (fread(dies[i].array, 1, die_size, f) != die_size) {
+                fprintf(stderr, "emu: short flash file '%s'\n", flash_path);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return 1;
+}
+
+void emu_nand_exit(void)
+{
+    size_t die_size = (size_t)die_pages() * raw_page;
+    FILE *f = flash_path ? fopen(flash_path, "wb") : NULL;
+
+    for (uint32_t i = 0; i < geo.ndies; i++) {
+        if (f) {
+            fwrite(dies[i].array, 1, die_size, f);
+        }
+        free(dies[i].array);
+        free(dies[i].cache);
+    }
+    if (f) {
+        fclose(f);
+    }
+}
@@ -0,0 +1,525 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ *
+ * Software FEL device: implements the subset of libusb used by xfel and
+ * dsoflash, and answers the Allwinner FEL protocol from emulated memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "emu.h"
+#include "../trace.h"
+
+#define FEL_VID             (0x1f3a)
+#define FEL_PID             (0xefe8)
+#define FEL_CHIP_ID         (0x00166300)                // F1C100s
+
+#define SRAM_ADDR           (0x00000000UL)
+#define SRAM_SZ             (64U*1024)
+#define SDRAM_ADDR          (0x80000000UL)
+#define SDRAM_SZ            (64U*1024*1024)
+
+#define SPI_PAYLOAD_ADDR    (0x00008800UL)
+#define USB_HS_SWITCH       (0x01c13040UL)
+#define PLL_DDR_CTRL        (0x01c20020UL)
+#define PLL_DDR_RESET       (0x00001000UL)
+#define PLL_DDR_ON          ((1UL << 31) | (1UL << 28)) // Enabled and locked
+#define WDOG_MODE           (0x01c20cb0UL)
+
+enum {
+    AW_USB_READ     = 0x11,
+    AW_USB_WRITE    = 0x12,
+};
+
+enum {
+    FEL_VERSION     = 0x001,
+    FEL_WRITE       = 0x101,
+    FEL_EXEC        = 0x102,
+    FEL_READ        = 0x103,
+};
+
+enum usb_state {
+    USB_IDLE,
+    USB_DATA_OUT,
+    USB_DATA_IN,
+    USB_STATUS,
+};
+
+enum fel_state {
+    FEL_IDLE,
+    FEL_VERSION_DATA,
+    FEL_WRITE_DATA,
+    FEL_READ_DATA,
+    FEL_STATUS,
+};
+
+struct libusb_device {
+    int high_speed;
+    uint8_t address;                                    // Changes when it re-enumerates
+};
+
+struct libusb_device_handle {
+    struct libusb_device *dev;
+};
+
+struct emu_timing emu_timing = {
+    .usb_latency_ns = 125000,                           // One HS microframe per transfer
+    .usb_byte_ps    = 40000,                            // ~25 MB/s
+    .exec_ns        = 50000,
+    .t_rd_ns        = 25000,
+    .t_prog_ns      = 300000,
+    .t_bers_ns      = 2000000,
+};
+
+struct emu_stats emu_stats;
+
+static uint8_t *sram, *sdram;
+static uint32_t pll_ddr = PLL_DDR_RESET;
+static struct libusb_device device = { .address = 2 };
+static struct libusb_device_handle handle = { &device };
+static int initialized;
+
+static struct {
+    enum usb_state state;
+    int request;
+    uint8_t *buf;
+    size_t len, pos, cap;
+} usb;
+
+static struct {
+    enum fel_state state;
+    uint32_t addr;
+    uint32_t len;
+} fel;
+
+static const struct libusb_endpoint_descriptor endpoints[] = {
+    { .bEndpointAddress = 0x01, .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK, .wMaxPacketSize = 512 },
+    { .bEndpointAddress = 0x82, .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK, .wMaxPacketSize = 512 },
+};
+static const struct libusb_interface_descriptor altsetting = {
+    .bNumEndpoints = 2,
+    .endpoint = endpoints,
+};
+static const struct libusb_interface interface = {
+    .altsetting = &altsetting,
+    .num_altsetting = 1,
+};
+static struct libusb_config_descriptor config = {
+    .bNumInterfaces = 1,
+    .interface = &interface,
+};
+
+uint8_t * emu_mem(uint32_t addr, uint32_t len)
+{
+    if (addr >= SDRAM_ADDR && (uint64_t)addr - SDRAM_ADDR + len <= SDRAM_SZ) {
+        return &sdram[addr - SDRAM_ADDR];
+    }
+    if ((uint64_t)addr + len <= SRAM_ADDR + SRAM_SZ) {
+        return &sram[addr - SRAM_ADDR];
+    }
+    return NULL;
+}
+
+// Trace timestamps follow the emulated clock
+uint64_t trace_clock_ns(void)
+{
+    return emu_stats.now_ns;
+}
+
+static uint64_t env_u64(const char *name, uint64_t def)
+{
+    const char *v = getenv(name);
+    return (v && *v) ? strtoull(v, NULL, 0) : def;
+}
+
+static void usb_time(size_t len)
+{
+    uint64_t t = emu_timing.usb_latency_ns + (len * emu_timing.usb_byte_ps) / 1000;
+    emu_stats.usb_ns += t;
+    emu_stats.now_ns += t;
+    emu_stats.usb_transfers++;
+}
+
+static void usb_buf_reserve(size_t len)
+{
+    if (len > usb.cap) {
+        usb.buf = realloc(usb.buf, len);
+        usb.cap = len;
+    }
+}
+
+static uint64_t exec_left_ns;   // Payload still running, the next request NAKs meanwhile
+
+static void fel_run(uint32_t addr)
+{
+    const uint8_t *p = emu_mem(addr, 0x30);
+    uint64_t t0 = emu_stats.now_ns;
+
+    emu_stats.execs++;
+    emu_stats.now_ns += emu_timing.exec_ns;
+
+    // The SPI payload is recognised by its entry loading the SDRAM command buffer address
+    static const uint8_t spi_entry[] = { 0x02, 0x01, 0xa0, 0xe3 };
+    static const uint8_t ddr_entry[] = { 0x6a, 0x01, 0x00, 0xeb };    // DDR init: bl to the training code
+    if (addr == SPI_PAYLOAD_ADDR && p && !memcmp(p + 0x28, spi_entry, sizeof (spi_entry))) {
+        emu_spi_run(SDRAM_ADDR);
+    } else if (addr == SPI_PAYLOAD_ADDR && p && !memcmp(p + 0x28, ddr_entry, sizeof (ddr_entry))) {
+        pll_ddr = PLL_DDR_ON | 0x1000;
+    }
+    exec_left_ns = emu_stats.now_ns - t0;
+}
+
+static void fel_request(const uint8_t *d)
+{
+    uint32_t req  = d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+    fel.addr      = d[4] | (d[5] << 8) | (d[6] << 16) | ((uint32_t)d[7] << 24);
+    fel.len       = d[8] | (d[9] << 8) | (d[10] << 16) | ((uint32_t)d[11] << 24);
+
+    switch (req) {
+    case FEL_VERSION:
+        fel.state = FEL_VERSION_DATA;
+        break;
+    case FEL_WRITE:
+        fel.state = FEL_WRITE_DATA;
+        break;
+    case FEL_READ:
+        fel.state = FEL_READ_DATA;
+        break;
+    case FEL_EXEC:
+        fel_run(fel.addr);
+        fel.state = FEL_STATUS;
+        break;
+    default:
+        fprintf(stderr, "emu: unknown FEL request 0x%x\n", req);
+        fel.state = FEL_STATUS;
+        break;
+    }
+}
+
+static void usb_write_done(void)
+{
+    if (fel.state == FEL_WRITE_DATA) {
+        uint8_t *m = emu_mem(fel.addr, usb.len);
+        if (m) {
+            memcpy(m, usb.buf, usb.len);
+        } else if (fel.addr == USB_HS_SWITCH) {
+            device.high_speed = 1;
+            device.address++;
+        } else if (fel.addr == WDOG_MODE && usb.len == 4 && (usb.buf[0] & 1)) {
+            pll_ddr = PLL_DDR_RESET;                    // Back in FEL at full speed, SDRAM untrained
+            device.high_speed = 0;
+            device.address++;
+        }
+        fel.state = FEL_STATUS;
+    } else if (usb.len == 16) {
+        fel_request(usb.buf);
+    }
+}
+
+static void usb_read_prepare(size_t len)
+{
+    usb_buf_reserve(len);
+    memset(usb.buf, 0, len);
+
+    switch (fel.state) {
+    case FEL_VERSION_DATA: {
+        uint32_t id = FEL_CHIP_ID;
+        memcpy(usb.buf, "AWUSBFEX", 8);
+        memcpy(usb.buf + 8, &id, 4);
+        fel.state = FEL_STATUS;
+        break;
+    }
+    case FEL_READ_DATA: {
+        const uint8_t *m = emu_mem(fel.addr, len);
+        if (m) {
+            memcpy(usb.buf, m, len);
+        } else if (fel.addr == PLL_DDR_CTRL && len == 4) {
+            memcpy(usb.buf, &pll_ddr, 4);
+        }
+        fel.state = FEL_STATUS;
+        break;
+    }
+    case FEL_STATUS:
+        fel.state = FEL_IDLE;
+        break;
+    default:
+        break;
+    }
+}
+
+static int bulk_out(const uint8_t *data, int length)
+{
+    switch (usb.state) {
+    case USB_IDLE:
+        if (length != 32 || memcmp(data, "AWUC", 4) != 0) {
+            return LIBUSB_ERROR_IO;
+        }
+        usb.request = data[16] | (data[17] << 8);
+        usb.len = data[8] | (data[9] << 8) | (data[10] << 16) | ((uint32_t)data[11] << 24);
+        usb.pos = 0;
+        if (usb.request == AW_USB_WRITE) {
+            usb_buf_reserve(usb.len);
+            usb.state = USB_DATA_OUT;
+        } else {
+            usb_read_prepare(usb.len);
+            usb.state = USB_DATA_IN;
+        }
+        return 0;
+
+    case USB_DATA_OUT:
+        if (usb.pos + length > usb.len) {
+            return LIBUSB_ERROR_OVERFLOW;
+        }
+        memcpy(usb.buf + usb.pos, data, length);
+        usb.pos += length;
+        emu_stats.usb_out += length;
+        if (usb.pos == usb.len) {
+            usb_write_done();
+            usb.state = USB_STATUS;
+        }
+        return 0;
+
+    default:
+        return LIBUSB_ERROR_PIPE;
+    }
+}
+
+static int bulk_in(uint8_t *data, int length, int *actual)
+{
+    switch (usb.state) {
+    case USB_DATA_IN: {
+        size_t n = usb.len - usb.pos;
+        if ((size_t)length < n) {
+            n = length;
+        }
+        memcpy(data, usb.buf + usb.pos, n);
+        usb.pos += n;
+        emu_stats.usb_in += n;
+        *actual = n;
+        if (usb.pos == usb.len) {
+            usb.state = USB_STATUS;
+        }
+        return 0;
+    }
+
+    case USB_STATUS:
+        memset(data, 0, length);
+        memcpy(data, "AWUS", length < 4 ? length : 4);
+        *actual = length < 13 ? length : 13;
+        usb.state = USB_IDLE;
+        return 0;
+
+    default:
+        return LIBUSB_ERROR_PIPE;
+    }
+}
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+                         unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+    int r, n = length;
+    (void)dev_handle;
+
+    if (exec_left_ns && usb.state == USB_IDLE) {
+        if (timeout && exec_left_ns > (uint64_t)timeout * 1000000) {
+            exec_left_ns -= (uint64_t)timeout * 1000000;
+            if (actual_length) {
+                *actual_length = 0;
+            }
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        exec_left_ns = 0;
+    }
+    if (endpoint & LIBUSB_ENDPOINT_IN) {
+        r = bulk_in(data, length, &n);
+    } else {
+        r = bulk_out(data, length);
+    }
+    usb_time(n);
+    if (actual_length) {
+        *actual_length = r ? 0 : n;
+    }
+    return r;
+}
+
+int libusb_init(libusb_context **ctx)
+{
+    if (ctx) {
+        *ctx = NULL;
+    }
+    if (initialized++) {
+        return 0;
+    }
+
+    emu_timing.usb_latency_ns = env_u64("DSOFLASH_EMU_USB_LATENCY_NS", emu_timing.usb_latency_ns);
+    emu_timing.usb_byte_ps    = env_u64("DSOFLASH_EMU_USB_BYTE_PS", emu_timing.usb_byte_ps);
+    emu_timing.exec_ns        = env_u64("DSOFLASH_EMU_EXEC_NS", emu_timing.exec_ns);
+    emu_timing.t_rd_ns        = env_u64("DSOFLASH_EMU_TRD_NS", emu_timing.t_rd_ns);
+    emu_timing.t_prog_ns      = env_u64("DSOFLASH_EMU_TPROG_NS", emu_timing.t_prog_ns);
+    emu_timing.t_bers_ns      = env_u64("DSOFLASH_EMU_TBERS_NS", emu_timing.t_bers_ns);
+
+    if (!sram) {                                        // Memory stays while the host lets go
+        sram = calloc(1, SRAM_SZ);
+        sdram = calloc(1, SDRAM_SZ);
+    }
+    if (!sram || !sdram) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    const char *chip = getenv("DSOFLASH_EMU_CHIP");
+    if (!emu_nand_init(chip ? chip : "W25N01GV", getenv("DSOFLASH_EMU_FLASH"), getenv("DSOFLASH_EMU_ECC"))) {
+        return LIBUSB_ERROR_OTHER;
+    }
+    return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+    (void)ctx;
+    if (!initialized || --initialized) {
+        return;
+    }
+
+    emu_nand_exit();
+    fprintf(stderr,
+            "emu: %.3f s virtual (usb %.3f s, spi %.3f s, nand busy %.3f s)\n"
+            "emu: usb out %llu B, in %llu B, %llu transfers, %llu execs, %llu loops\n"
+            "emu: %llu page reads, %llu page programs, %llu block erases, %llu violations\n",
+            emu_stats.now_ns / 1e9, emu_stats.usb_ns / 1e9, emu_stats.spi_ns / 1e9, emu_stats.wait_ns / 1e9,
+            (unsigned long long)emu_stats.usb_out, (unsigned long long)emu_stats.usb_in,
+            (unsigned long long)emu_stats.usb_transfers, (unsigned long long)emu_stats.execs, (unsigned long long)emu_stats.loops,
+            (unsigned long long)emu_stats.page_reads, (unsigned long long)emu_stats.page_programs,
+            (unsigned long long)emu_stats.block_erases, (unsigned long long)emu_stats.violations);
+
+    free(usb.buf);
+    memset(&usb, 0, sizeof (usb));                      // Still powered, a daemon may open it again
+    memset(&fel, 0, sizeof (fel));
+}
+
+libusb_device_handle * libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
+{
+    (void)ctx;
+    if (vendor_id != FEL_VID || product_id != FEL_PID) {
+        return NULL;
+    }
+    memset(&usb, 0, offsetof(__typeof__(usb), buf));
+    fel.state = FEL_IDLE;
+    return &handle;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    (void)dev;
+    *dev_handle = libusb_open_device_with_vid_pid(NULL, FEL_VID, FEL_PID);
+    return 0;
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    (void)ctx;
+    if (!(*list = calloc(2, sizeof (**list)))) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    (*list)[0] = &device;
+    return 1;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    (void)unref_devices;
+    free(list);
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+    (void)dev;
+    return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+    return dev->address;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+    (void)dev;
+    if (port_numbers_len < 1) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+    port_numbers[0] = 1;
+    return 1;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+    (void)dev_handle;
+}
+
+libusb_device * libusb_get_device(libusb_device_handle *dev_handle)
+{
+    return dev_handle->dev;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    return interface_number == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return 0;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **cfg)
+{
+    (void)dev;
+    *cfg = &config;
+    return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *cfg)
+{
+    (void)cfg;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    (void)dev;
+    memset(desc, 0, sizeof (*desc));
+    desc->idVendor = FEL_VID;
+    desc->idProduct = FEL_PID;
+    desc->bNumConfigurations = 1;
+    return 0;
+}
+
+int libusb_get_device_speed(libusb_device *dev)
+{
+    return dev->high_speed ? LIBUSB_SPEED_HIGH : LIBUSB_SPEED_FULL;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return 0;
+}
+
+const char * libusb_error_name(int errcode)
+{
+    return errcode ? "LIBUSB_ERROR" : "LIBUSB_SUCCESS";
+}
@@ -4,17 +4,187 @@
  * Copyright 2007-2022 Jianjun Jiang <8192542@qq.com>
  */
 
+#include <pthread.h>
+
 #include <fel.h>
 
+#include "f1c100s_f1c200s_f1c500s.h"
+#include "report.h"
+
 #define SDRAM_ADDR          (0x80000000UL)              // SDRAM base address
 
 #define SDRAM_CMDBUF        (SDRAM_ADDR)                // cmd buffer address
 #define SDRAM_CMDBUF_SZ     (1024U*1024)                // cmd buffer size (1MB)
 
-#define SDRAM_DATABUF       (SDRAM_ADDR+SDRAM_CMDBUF_SZ)// data buffer address
-#define SDRAM_DATABUF_SZ    (63U*1024*1024)             // dat buffer size(63MB)
+#define SDRAM_DATABUF       (F1C100S_SWAPBUF)           // data buffer address
+#define SDRAM_DATABUF_SZ    (63U*1024*1024 - SDRAM_MARK_SZ) // dat buffer size(63MB, but the mark)
+
+#define SDRAM_MARK          (SDRAM_DATABUF + SDRAM_DATABUF_SZ)  // Written after DDR init, see chip_sdram_trained()
+#define SDRAM_MARK_SZ       (4096U)
+
+#define PLL_DDR_CTRL        (0x01c20020UL)
+#define PLL_DDR_ON          ((1UL << 31) | (1UL << 28)) // Enabled and locked, both clear after reset
+
+#define SPI_PAYLOAD_CCR     (0x4b0)                     // Offset of the SPI_CCR literal in the SPI payload
+#define SPI_CCR_DRS         (1U << 12)                  // Divide rate select: use CDR2
+
+#define FEL_EXEC_POLL_MS    (1000U)                     // USB timeout per transfer while a long exec runs
+
+/*
+ * What this side knows about each device, found by its xfel context: the
+ * chip ops of xfel only get that, and one process may drive several devices.
+ */
+struct f1c100s_state_t {
+    const struct xfel_ctx_t *ctx;
+    struct f1c100s_state_t *next;
+    uint8_t sdram_initialized;
+    uint32_t cmdbuf_gen;                                // Bumped on every write to the cmd buffer
+    uint32_t spi_ccr;
+    uint32_t payload_ccr;                               // spi_ccr of the payload at 0x8800, 0 for none
+    uint32_t session;                                   // Bumped on reset
+};
+
+static const char sdram_mark[16] = "dsoflash ddr ok";
+
+static struct f1c100s_state_t *states;
+static pthread_mutex_t states_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct f1c100s_state_t * chip_state(const struct xfel_ctx_t *ctx)
+{
+    static struct f1c100s_state_t fallback = { .spi_ccr = SPI_CCR_DRS | 1 };   // Out of memory: one state shared by all
+    struct f1c100s_state_t *st;
+
+    pthread_mutex_lock(&states_lock);
+    for (st = states; st && st->ctx != ctx; st = st->next) {
+    }
+    if (!st && (st = calloc(1, sizeof (*st)))) {
+        st->ctx = ctx;
+        st->spi_ccr = SPI_CCR_DRS | 1;                  // AHB/4, as in the stock payload
+        st->next = states;
+        states = st;
+    }
+    pthread_mutex_unlock(&states_lock);
+
+    return st ? st : &fallback;
+}
+
+void f1c100s_release(const struct xfel_ctx_t *ctx)
+{
+    pthread_mutex_lock(&states_lock);
+    for (struct f1c100s_state_t **p = &states; *p; p = &(*p)->next) {
+        if ((*p)->ctx == ctx) {
+            struct f1c100s_state_t *st = *p;
+            *p = st->next;
+            free(st);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&states_lock);
+}
+
+uint32_t f1c100s_spi_clock_set(const struct xfel_ctx_t *ctx, uint32_t hz)
+{
+    uint32_t cdr2 = 0;
 
-static uint8_t sdram_initialized;
+    if (hz && hz < F1C100S_AHB_CLK/2) {
+        cdr2 = (F1C100S_AHB_CLK + 2*hz - 1) / (2*hz) - 1;   // Round towards the slower clock
+    }
+    if (cdr2 > 0xFF) {
+        cdr2 = 0xFF;
+    }
+    chip_state(ctx)->spi_ccr = SPI_CCR_DRS | cdr2;      // Applied by SPI_CMD_INIT on the next fel_spi_init()
+    return f1c100s_spi_clock_get(ctx);
+}
+
+uint32_t f1c100s_spi_clock_get(const struct xfel_ctx_t *ctx)
+{
+    return F1C100S_AHB_CLK / (2 * ((chip_state(ctx)->spi_ccr & 0xFF) + 1));
+}
+
+void f1c100s_spi_cmdbuf_write(struct xfel_ctx_t *ctx, uint32_t offset, const void *buf, uint32_t len)
+{
+    fel_write(ctx, SDRAM_CMDBUF + offset, (void *)buf, len);
+    chip_state(ctx)->cmdbuf_gen++;
+}
+
+void f1c100s_spi_exec(struct xfel_ctx_t *ctx)
+{
+    fel_exec(ctx, 0x00008800);                          // Execute SPI payload (Previously loaded to 0x8800)
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int fel_bulk(struct xfel_ctx_t *ctx, int ep, uint8_t *buf, int len, uint32_t *tries)
+{
+    while (len > 0) {
+        int n = 0;
+        int r = libusb_bulk_transfer(ctx->hdl, ep, buf, len, &n, FEL_EXEC_POLL_MS);
+        buf += n;
+        len -= n;
+        if (r == LIBUSB_ERROR_TIMEOUT && *tries > 0) {  // BROM NAKs until the payload returns
+            (*tries)--;
+        } else if (r != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// One AWUC/AWUS framed transfer, as usb_write()/usb_read() of xfel
+static int fel_usb(struct xfel_ctx_t *ctx, uint16_t type, uint8_t *buf, uint32_t len, uint32_t *tries)
+{
+    uint8_t req[32] = "AWUC";
+    uint8_t status[13];
+
+    put_le32(&req[8], len);
+    put_le32(&req[12], 0x0c000000);
+    req[16] = type;
+    req[17] = type >> 8;
+    put_le32(&req[18], len);
+
+    return fel_bulk(ctx, ctx->epout, req, sizeof (req), tries)
+        && fel_bulk(ctx, (type == 0x12) ? ctx->epout : ctx->epin, buf, len, tries)
+        && fel_bulk(ctx, ctx->epin, status, sizeof (status), tries);
+}
+
+/*
+ * fel_exec() with room for command streams running longer than the USB
+ * timeout of xfel: the BROM only answers the status request once the
+ * payload returns, so that request is retried for up to timeout_ms.
+ */
+int f1c100s_spi_exec_wait(struct xfel_ctx_t *ctx, uint32_t timeout_ms)
+{
+    uint8_t req[16] = { 0 };
+    uint8_t status[8];
+    uint32_t tries = timeout_ms / FEL_EXEC_POLL_MS;
+
+    put_le32(&req[0], 0x102);                           // FEL exec
+    put_le32(&req[4], 0x00008800);                      // SPI payload
+    if (!fel_usb(ctx, 0x12, req, sizeof (req), &tries) || !fel_usb(ctx, 0x11, status, sizeof (status), &tries)) {
+        printf("SPI payload did not return within %u ms!\n", timeout_ms);
+        return 0;
+    }
+    if (tries < timeout_ms / FEL_EXEC_POLL_MS) {
+        report_retry("exec-poll", timeout_ms / FEL_EXEC_POLL_MS - tries);
+    }
+    return 1;
+}
+
+uint32_t f1c100s_spi_cmdbuf_gen(const struct xfel_ctx_t *ctx)
+{
+    return chip_state(ctx)->cmdbuf_gen;
+}
+
+uint32_t f1c100s_session(const struct xfel_ctx_t *ctx)
+{
+    return chip_state(ctx)->session;
+}
 
 static int chip_detect(struct xfel_ctx_t *ctx, uint32_t id)
 {
@@ -26,8 +196,13 @@ static int chip_detect(struct xfel_ctx_t *ctx, uint32_t id)
 
 static int chip_reset(struct xfel_ctx_t *ctx)
 {
+    struct f1c100s_state_t *st = chip_state(ctx);
     uint32_t val;
 
+    st->sdram_initialized = 0;
+    st->payload_ccr = 0;
+    st->session++;
+
     val = R32(0x01c20ca0 + 0x18);
     val &= ~(0xf << 4);
     val |= (1 << 4) | (0x1 << 0);
@@ -83,6 +258,7 @@ static int chip_jtag(struct xfel_ctx_t *ctx)
     };
     fel_write(ctx, 0x00008800, (void *)&payload[0], sizeof (payload));
     fel_exec(ctx, 0x00008800);
+    chip_state(ctx)->payload_ccr = 0;                   // Took the place of the SPI payload
     return 1;
 }
 
@@ -431,10 +607,28 @@ static int chip_ddr(struct xfel_ctx_t *ctx, const char *type)
     fel_write(ctx, 0x00008800, (void *)&payload[0], sizeof (payload));
     fel_exec(ctx, 0x00008800);
     usleep(100000);                                                                 // Wait 100ms for sdram init in SoC (Otherwise it might cause USB bulk error)
-    sdram_initialized = 1;
+    fel_write(ctx, SDRAM_MARK, (void *)sdram_mark, sizeof (sdram_mark));            // Found by the next runs until reset or power off
+    chip_state(ctx)->sdram_initialized = 1;
+    chip_state(ctx)->cmdbuf_gen++;
+    chip_state(ctx)->payload_ccr = 0;                                               // Took the place of the SPI payload
     return 1;
 }
 
+/*
+ * DDR trained by an earlier run: its PLL runs (reading SDRAM behind an idle
+ * controller could hang the bus) and the mark chip_ddr() left is still there.
+ */
+static int chip_sdram_trained(struct xfel_ctx_t *ctx)
+{
+    char mark[sizeof (sdram_mark)];
+
+    if ((R32(PLL_DDR_CTRL) & PLL_DDR_ON) != PLL_DDR_ON) {
+        return 0;
+    }
+    fel_read(ctx, SDRAM_MARK, mark, sizeof (mark));
+    return !memcmp(mark, sdram_mark, sizeof (mark));
+}
+
 static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *swaplen, uint32_t *cmdlen)
 {
     static const uint8_t payload[] = {
@@ -495,7 +689,8 @@ static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *sw
         0x48, 0x00, 0x00, 0x0a, 0x04, 0x00, 0x53, 0xe3, 0x4c, 0x00, 0x00, 0x0a,
         0x05, 0x00, 0x53, 0xe3, 0x51, 0x00, 0x00, 0x0a, 0x06, 0x00, 0x53, 0xe3,
         0x60, 0x00, 0x00, 0x0a, 0x07, 0x00, 0x53, 0xe3, 0x6f, 0x00, 0x00, 0x0a,
-        0x08, 0x00, 0x53, 0xe3, 0x7c, 0x00, 0x00, 0x1a, 0x0d, 0x90, 0xa0, 0xe1,
+        // 0x08, 0x00, 0x53, 0xe3, 0x7c, 0x00, 0x00, 0x1a, 0x0d, 0x90, 0xa0, 0xe1,     // Original, unknown opcodes end the run
+        0x08, 0x00, 0x53, 0xe3, 0x82, 0x00, 0x00, 0x1a, 0x0d, 0x90, 0xa0, 0xe1,             // Unknown opcodes go to the extension at 0x4b4 instead
         0x08, 0x60, 0x8d, 0xe2, 0xb0, 0x80, 0xcd, 0xe1, 0x02, 0x10, 0xa0, 0xe3,
         0x09, 0x00, 0xa0, 0xe1, 0xb0, 0xff, 0xff, 0xeb, 0x01, 0x10, 0xa0, 0xe3,
         0x06, 0x00, 0xa0, 0xe1, 0x73, 0xff, 0xff, 0xeb, 0x08, 0x30, 0xdd, 0xe5,
@@ -539,13 +734,86 @@ static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *sw
         0x01, 0x00, 0x13, 0xe3, 0xf6, 0xff, 0xff, 0x1a, 0x04, 0x60, 0xa0, 0xe1,
         0x8f, 0xff, 0xff, 0xea, 0x14, 0xd0, 0x8d, 0xe2, 0xf0, 0x83, 0xbd, 0xe8,
         0x0f, 0xc0, 0xff, 0xff, 0x00, 0x50, 0xc0, 0x01, 0x00, 0x00, 0xc2, 0x01,
-        0x01, 0x10, 0x00, 0x00
+        0x01, 0x10, 0x00, 0x00,                                                             // SPI_CCR, patched by chip_spi_init()
+        /*
+         * Extension: SPI_CMD_LOOP / SPI_CMD_NEXT / SPI_CMD_CHECKFF, entered from
+         * the dispatcher with r3 = opcode, r4 = cmd+1, r6 = cmd. Loop state
+         * lives in the 5 words at the end: remaining, count, nfields, fields, body.
+         *
+         * 0x4b4: cmp r3, #9;  beq loop;  cmp r3, #11;  beq check
+         *        cmp r3, #10;  bne 0x49c (end)
+         * next:  adr r9, state;  ldr r0, [r9];  subs r0, r0, #1;  str r0, [r9]
+         *        ldreq r1, [r9, #4];  rsbeq r0, r1, #1;  movne r0, #1
+         *        bl patch;  ldr r0, [r9];  cmp r0, #0
+         *        ldrne r6, [r9, #16];  moveq r6, r4;  b 0x260 (dispatch)
+         * loop:  r0 = le32 [r6+1];  orrs ...;  beq 0x49c
+         *        ldrb r1, [r6, #5];  add r2, r6, #6;  rsb r3, r1, r1, lsl #3
+         *        adr r9, state;  str r0, [r9];  str r0, [r9, #4];  str r1, [r9, #8]
+         *        str r2, [r9, #12];  add r6, r2, r3;  str r6, [r9, #16];  b 0x260
+         * check: r2 = le32 [r4], r3 = le32 [r4+4], r0 = le32 [r4+8] (via le32)
+         *        mvn r1, #0;  and every word of [r2, r2+r3) into r1, fold to a byte
+         *        ldrb ip, [r0];  and ip, ip, r1;  strb ip, [r0];  mov r6, r4;  b 0x260
+         * le32:  r0 = le32 [r4], r4 += 4;  mov pc, lr
+         * patch: push {r4-r8, lr}, then for each field r8 = stride * r0 is added
+         *        byte by byte with carry to the field, walking down from the
+         *        last byte for big endian fields; pop {r4-r8, pc}
+         */
+        0x09, 0x00, 0x53, 0xe3, 0x10, 0x00, 0x00, 0x0a, 0x0b, 0x00, 0x53, 0xe3,
+        0x21, 0x00, 0x00, 0x0a, 0x0a, 0x00, 0x53, 0xe3, 0xf3, 0xff, 0xff, 0x1a,
+        0x5e, 0x9f, 0x8f, 0xe2, 0x00, 0x00, 0x99, 0xe5, 0x01, 0x00, 0x50, 0xe2,
+        0x00, 0x00, 0x89, 0xe5, 0x04, 0x10, 0x99, 0x05, 0x01, 0x00, 0x61, 0x02,
+        0x01, 0x00, 0xa0, 0x13, 0x30, 0x00, 0x00, 0xeb, 0x00, 0x00, 0x99, 0xe5,
+        0x00, 0x00, 0x50, 0xe3, 0x10, 0x60, 0x99, 0x15, 0x04, 0x60, 0xa0, 0x01,
+        0x57, 0xff, 0xff, 0xea, 0x01, 0x00, 0xd6, 0xe5, 0x02, 0x10, 0xd6, 0xe5,
+        0x01, 0x04, 0x80, 0xe1, 0x03, 0x10, 0xd6, 0xe5, 0x01, 0x08, 0x80, 0xe1,
+        0x04, 0x10, 0xd6, 0xe5, 0x01, 0x0c, 0x90, 0xe1, 0xde, 0xff, 0xff, 0x0a,
+        0x05, 0x10, 0xd6, 0xe5, 0x06, 0x20, 0x86, 0xe2, 0x81, 0x31, 0x61, 0xe0,
+        0x46, 0x9f, 0x8f, 0xe2, 0x00, 0x00, 0x89, 0xe5, 0x04, 0x00, 0x89, 0xe5,
+        0x08, 0x10, 0x89, 0xe5, 0x0c, 0x20, 0x89, 0xe5, 0x03, 0x60, 0x82, 0xe0,
+        0x10, 0x60, 0x89, 0xe5, 0x44, 0xff, 0xff, 0xea, 0x0f, 0x00, 0x00, 0xeb,
+        0x00, 0x20, 0xa0, 0xe1, 0x0d, 0x00, 0x00, 0xeb, 0x00, 0x30, 0xa0, 0xe1,
+        0x0b, 0x00, 0x00, 0xeb, 0x00, 0x10, 0xe0, 0xe3, 0x04, 0x30, 0x53, 0xe2,
+        0x04, 0xc0, 0x92, 0xa4, 0x0c, 0x10, 0x01, 0xa0, 0xfb, 0xff, 0xff, 0xaa,
+        0x21, 0x18, 0x01, 0xe0, 0x21, 0x14, 0x01, 0xe0, 0x00, 0xc0, 0xd0, 0xe5,
+        0x01, 0xc0, 0x0c, 0xe0, 0x00, 0xc0, 0xc0, 0xe5, 0x04, 0x60, 0xa0, 0xe1,
+        0x33, 0xff, 0xff, 0xea, 0x01, 0x00, 0xd4, 0xe4, 0x01, 0x10, 0xd4, 0xe4,
+        0x01, 0x04, 0x80, 0xe1, 0x01, 0x10, 0xd4, 0xe4, 0x01, 0x08, 0x80, 0xe1,
+        0x01, 0x10, 0xd4, 0xe4, 0x01, 0x0c, 0x80, 0xe1, 0x0e, 0xf0, 0xa0, 0xe1,
+        0xf0, 0x41, 0x2d, 0xe9, 0x0c, 0x40, 0x99, 0xe5, 0x08, 0x50, 0x99, 0xe5,
+        0x10, 0x60, 0x99, 0xe5, 0x00, 0x70, 0xa0, 0xe1, 0x01, 0x50, 0x55, 0xe2,
+        0xf0, 0x81, 0xbd, 0xb8, 0x00, 0x00, 0xd4, 0xe5, 0x01, 0x10, 0xd4, 0xe5,
+        0x01, 0x04, 0x80, 0xe1, 0x00, 0x00, 0x86, 0xe0, 0x02, 0x20, 0xd4, 0xe5,
+        0x03, 0x10, 0xd4, 0xe5, 0x04, 0x30, 0xd4, 0xe5, 0x03, 0x14, 0x81, 0xe1,
+        0x05, 0x30, 0xd4, 0xe5, 0x03, 0x18, 0x81, 0xe1, 0x06, 0x30, 0xd4, 0xe5,
+        0x03, 0x1c, 0x81, 0xe1, 0x91, 0x07, 0x08, 0xe0, 0x01, 0x30, 0xa0, 0xe3,
+        0x80, 0x00, 0x12, 0xe3, 0x07, 0x20, 0x02, 0xe2, 0x02, 0x00, 0x80, 0x10,
+        0x01, 0x00, 0x40, 0x12, 0x00, 0x30, 0xe0, 0x13, 0x00, 0xc0, 0xa0, 0xe3,
+        0x01, 0x20, 0x52, 0xe2, 0x07, 0x00, 0x00, 0xba, 0x00, 0xe0, 0xd0, 0xe5,
+        0x0c, 0xe0, 0x8e, 0xe0, 0xff, 0xc0, 0x08, 0xe2, 0x0c, 0xe0, 0x8e, 0xe0,
+        0x03, 0xe0, 0xc0, 0xe6, 0x2e, 0xc4, 0xa0, 0xe1, 0x28, 0x84, 0xa0, 0xe1,
+        0xf5, 0xff, 0xff, 0xea, 0x07, 0x40, 0x84, 0xe2, 0xdd, 0xff, 0xff, 0xea,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
     };
-    if (!sdram_initialized) {
+    struct f1c100s_state_t *st = chip_state(ctx);
+
+    if (!st->sdram_initialized && chip_sdram_trained(ctx)) {
+        st->sdram_initialized = 1;
+    } else if (!st->sdram_initialized) {
         chip_ddr(ctx, "");                                                              // Init sdram required, the payload was modified to use buffer in SDRAM
     }
 
-    fel_write(ctx, 0x00008800, (void *)&payload[0], sizeof (payload));                      // 0x8800 is the payload address
+    if (st->payload_ccr != st->spi_ccr) {                                               // Otherwise still there from the last init, same clock
+        uint8_t buf[sizeof (payload)];
+        memcpy(buf, payload, sizeof (payload));
+        buf[SPI_PAYLOAD_CCR+0] = (st->spi_ccr>>0)  & 0xFF;                                          // Patch in the selected SPI clock divider
+        buf[SPI_PAYLOAD_CCR+1] = (st->spi_ccr>>8)  & 0xFF;
+        buf[SPI_PAYLOAD_CCR+2] = (st->spi_ccr>>16) & 0xFF;
+        buf[SPI_PAYLOAD_CCR+3] = (st->spi_ccr>>24) & 0xFF;
+
+        fel_write(ctx, 0x00008800, buf, sizeof (buf));                                          // 0x8800 is the payload address
+        st->payload_ccr = st->spi_ccr;
+    }
 
     if (swapbuf) {
         *swapbuf = SDRAM_DATABUF;
@@ -561,8 +829,8 @@ static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *sw
 
 static int chip_spi_run(struct xfel_ctx_t *ctx, uint8_t *cbuf, uint32_t clen)
 {
-    fel_write(ctx, SDRAM_CMDBUF, (void *)cbuf, clen);                                       // Write SPI cmd buf into SDRAM buffer
-    fel_exec(ctx, 0x00008800);                                                              // Execute SPI payload (Previously loaded to 0x8800)
+    f1c100s_spi_cmdbuf_write(ctx, 0, cbuf, clen);                                           // Write SPI cmd buf into SDRAM buffer
+    f1c100s_spi_exec(ctx);
     return 1;
 }
 
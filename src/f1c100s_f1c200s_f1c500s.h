@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef F1C100S_F1C200S_F1C500S_H_
+#define F1C100S_F1C200S_F1C500S_H_
+
+#include <fel.h>
+
+#define F1C100S_AHB_CLK     (200000000UL)               // AHB clock after the DDR payload has set up the PLLs
+#define F1C100S_SWAPBUF     (0x80100000UL)              // SDRAM data buffer the SPI payload reads and writes pages in
+
+// SPI0 runs at AHB / (2 * (CDR2 + 1)), the stock payload uses CDR2 = 1 (50 MHz)
+uint32_t f1c100s_spi_clock_set(const struct xfel_ctx_t *ctx, uint32_t hz);
+uint32_t f1c100s_spi_clock_get(const struct xfel_ctx_t *ctx);
+
+// Clock, SDRAM and cmd buffer state are kept per xfel context until released
+void f1c100s_release(const struct xfel_ctx_t *ctx);
+
+/*
+ * Opcodes added to the SPI payload on top of the SPI_CMD_* set of xfel.
+ *
+ * SPI_CMD_LOOP count(le32) nfields(u8) fields[nfields] body... SPI_CMD_NEXT
+ *
+ * runs the body count times. Each field is offset(le16) flags(u8) stride(le32):
+ * after every pass stride is added to the field at offset into the body, so
+ * page and buffer addresses step along. Fields are back to their initial
+ * values once the loop ends. Loops don't nest; a count of 0 ends the run.
+ *
+ * SPI_CMD_CHECKFF addr(le32) len(le32) result(le32)
+ *
+ * ands every byte of the len bytes at addr into the byte at result, so a
+ * result preset to 0xFF stays 0xFF only if all the data checked was blank.
+ * addr and len must be multiples of 4.
+ */
+enum {
+    SPI_CMD_LOOP            = 0x09,
+    SPI_CMD_NEXT            = 0x0a,
+    SPI_CMD_CHECKFF         = 0x0b,
+};
+
+#define SPI_LOOP_FIELD_SZ   (7U)
+#define SPI_LOOP_LE(n)      (n)                         // n byte little endian field, e.g. TXBUF/RXBUF address
+#define SPI_LOOP_BE(n)      (0x80U | (n))               // n byte big endian field, e.g. page address of a FAST command
+
+/*
+ * Partial command buffer uploads: f1c100s_spi_cmdbuf_write() places bytes at
+ * an offset of the command buffer, f1c100s_spi_exec() runs whatever it holds
+ * (f1c100s_spi_exec_wait() for streams that may outlast the USB timeout).
+ * The generation changes on every write to the command buffer (these, a
+ * fel_chip_spi_run() or SDRAM init), so a caller that remembers it after its
+ * own upload can tell whether the device still has its bytes.
+ */
+void f1c100s_spi_cmdbuf_write(struct xfel_ctx_t *ctx, uint32_t offset, const void *buf, uint32_t len);
+void f1c100s_spi_exec(struct xfel_ctx_t *ctx);
+int f1c100s_spi_exec_wait(struct xfel_ctx_t *ctx, uint32_t timeout_ms);
+uint32_t f1c100s_spi_cmdbuf_gen(const struct xfel_ctx_t *ctx);
+
+/*
+ * fel_spi_init() uploads the SPI payload only when it isn't resident with
+ * the current clock. The session changes on fel_chip_reset(), anything set
+ * up on the flash before belongs to an older one.
+ */
+uint32_t f1c100s_session(const struct xfel_ctx_t *ctx);
+
+#endif // F1C100S_F1C200S_F1C500S_H_
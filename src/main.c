@@ -3,30 +3,48 @@
  * Copyright 2022-2024 DavidAlfa
  */
 
-#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <fel.h>
 
+#include "dsoflash.h"
 #include "spinand.h"
+#include "trace.h"
+#include "stats.h"
+#include "report.h"
 #include "md5.h"
+#include "store.h"
+#include "daemon/dsoflashd.h"
 
+#define MD5_CHUNK           (1024U*1024*1024)
 
-static struct xfel_ctx_t ctx;
-static char Name[128];
-static size_t capacity;
-static uint32_t read_bytes;
+
+static struct dsoflash_t *dev;
+static uint64_t capacity;
+static uint64_t read_bytes;
 static char *flashbf, *filebf;
 static char filename[128];
 static char ext[16];
 static char *dot;
-static time_t start;
+static uint64_t start;
+static const char *spi_clock;
+static int blank_check, sparse_read;
+static uint32_t erase_chunk;
+static const char *trace_path;
+static int trace_md5;
+static int replay_destructive;
+static const char *stats_path;                 // NULL for stdout
+static int progress_fd = -1;                   // JSON lines progress, -1 for the terminal bar
+static const char *daemon_path;                // dsoflashd socket, NULL to open the device here
+static const char *store_dir;                  // Block store images go to and come from as manifests, NULL for plain files
 
 static int terminal_error(void)
 {
-    if (ctx.hdl) {
-        libusb_close(ctx.hdl);
-    }
-    libusb_exit(NULL);
+    dsoflash_close(dev);
     if (flashbf) {
         free(flashbf);
     }
@@ -36,36 +54,48 @@ static int terminal_error(void)
     exit(-1);
 }
 
-static uint32_t file_save(const char *filename, void *buf, uint32_t len)
+static int file_save(const char *filename, void *buf, uint64_t len)
 {
+    uint64_t t = stats_begin();
     FILE *out = fopen(filename, "wb");
-    uint32_t r;
+    int r;
     if (!out) {
         return 0;
     }
     r = fwrite(buf, len, 1, out);
-    fclose(out);
+    if (fclose(out)) {
+        r = 0;
+    }
+    stats_end(STATS_FILE, t, len);
     return r;
 }
 
-static void * file_load(const char *filename, uint32_t *len)
+static void * file_load(const char *filename, uint64_t *len)
 {
-    uint32_t size, n;
+    uint64_t t = stats_begin();
+    uint64_t size, n;
+    off_t end;
     FILE *in;
     char *buf;
     in = fopen(filename, "rb");
+    if (!in) {
+        return NULL;
+    }
 
-    fseek(in, 0, SEEK_END);       // seek to end of file
-    size = ftell(in);             // get current file pointer
-    fseek(in, 0, SEEK_SET);       // seek back to beginning of file
-    buf = malloc(size);        // allocate size
+    fseeko(in, 0, SEEK_END);      // seek to end of file
+    end = ftello(in);             // get current file pointer
+    fseeko(in, 0, SEEK_SET);      // seek back to beginning of file
+    size = (end > 0) ? (uint64_t)end : 0;
+    buf = (size == (size_t)size) ? malloc(size ? size : 1) : NULL;   // allocate size
     if (!buf) {
         //printf("Unable to allocate file buffer!\n");
+        fclose(in);
         return NULL;
     }
     n = fread(buf, 1, size, in);  // Read whole file
     if (n < size) {                // Ensure it was completely read
         free(buf);
+        fclose(in);
         return NULL;
     }
     if (len) {
@@ -74,6 +104,7 @@ static void * file_load(const char *filename, uint32_t *len)
     if (in != stdin) {
         fclose(in);
     }
+    stats_end(STATS_FILE, t, n);
     return buf;
 }
 
@@ -91,54 +122,241 @@ static void usage(void)
     printf("    dsoflash reset                                - Restart device\n");
     printf("    dsoflash read <file>                          - Dump flash to file\n");
     printf("    dsoflash write <file>                         - Restore flash from file\n");
-    printf("    dsoflash erase                                - Erase flash\n\n");
+    printf("    dsoflash erase                                - Erase flash\n");
+    printf("    dsoflash verify <file>                        - Compare flash with file\n");
+    printf("    dsoflash health                               - ECC status of every page, without reading the data\n");
+    printf("    dsoflash run <job>                            - Run the verbs listed in job ('-' for stdin) in one session\n");
+    printf("    dsoflash replay <trace>                       - Re-run a --trace recording, compare timings\n\n");
+    printf("Options:\n");
+    printf("    --spi-clock <MHz>                             - Set SPI clock (default 50)\n");
+    printf("    --spi-clock auto                              - Find fastest reliable SPI clock, cache it per flash model\n");
+    printf("    --spi-clock cached                            - Use cached SPI clock for this flash model, calibrate if none\n");
+    printf("    --erase-chunk <blocks>                        - Blocks per die erased in one go (default all)\n");
+    printf("    --blank-check                                 - Read the flash first, erase only blocks with data\n");
+    printf("    --sparse-read                                 - Don't transfer pages of 0xFF when reading, checked on the device\n");
+    printf("    --trace <file>                                - Record all FEL transfers to file\n");
+    printf("    --trace-md5                                   - Add md5 of the transferred data to the trace\n");
+    printf("    --destructive                                 - Let replay run erase/write traces, ERASES THE FLASH\n");
+    printf("    --stats json[:<file>]                         - Report time per phase and part of the work at exit\n");
+    printf("    --progress=jsonl[:<fd>]                       - Progress as JSON lines on fd (default 2) instead of a bar\n");
+    printf("    --daemon <socket>                             - Run the command in dsoflashd listening on socket\n");
+    printf("    --store <dir>                                 - read/write/verify a manifest of erase blocks kept once in dir\n\n");
     printf("Warning: Commands will be executed inmediately, without confirmation!\n");
 }
 
-static int init_system(void)
+static int usb_hs_mode(void *user)
 {
-    int init = 0;
+    int err;
 
     printf("\nConfiguring USB to HS mode... ");
-    fel_write32(&ctx, 0x01c13040, 0x29860);
-    libusb_close(ctx.hdl);                                                  // Close USB
-
-    for (int i = 0; i < 10; i++) {                                                // Try for 10 seconds
-        sleep(1);                                                           // Wait 1 seconds for USB reenumeration
-        ctx.hdl = libusb_open_device_with_vid_pid(NULL, 0x1f3a, 0xefe8);    // Open USB device
-        if (ctx.hdl) {                                                       // If sucessfull
-            init = fel_init(&ctx);                                          // Try initialization
-            if (init) {
-                break;
-            }                                                               // Break on success
-            libusb_close(ctx.hdl);                                          // Otherwise close handler and retry
-        }
+    if ((err = dsoflash_hs_mode(user)) != DSOFLASH_OK) {
+        printf("ERROR: %s\n", dsoflash_strerror(err));
+        return 0;
     }
+    printf("OK\n");
+    return 1;
+}
+
+// What a job has done to the device already, so later steps don't redo it
+static int hs_mode, clock_set;
 
-    if (!init) {
-        printf("ERROR: No FEL device found\n");
+static void session_reset(void)
+{
+    hs_mode = clock_set = 0;
+    capacity = 0;
+}
+
+static int init_system(void)
+{
+    if (!hs_mode && !usb_hs_mode(dev)) {
         return -1;
-    } else {
-        printf("OK\n");
     }
+    hs_mode = 1;
 
-    if (!spinand_detect(&ctx, Name, &capacity)) {
+    if (dsoflash_detect(dev) != DSOFLASH_OK) {
         terminal_error();
         printf("Unknown flash memory!\n");
         return 1;
     }
-    printf("Flash found: '%s'  Size: %zu MB\n\n", Name, capacity/((size_t)1024*1024));
+    capacity = dsoflash_capacity(dev);
+    printf("Flash found: '%s'  Size: %llu MB\n\n", dsoflash_name(dev), (unsigned long long)(capacity/(1024*1024)));
     return 0;
 }
 
-void compute_md5(char *data, uint32_t len, char *digest)
+static int spi_clock_cache_path(char *path, size_t len)
+{
+    const char *dir = getenv("XDG_CACHE_HOME");
+
+    if (dir && *dir) {
+        mkdir(dir, 0755);
+        snprintf(path, len, "%s/dsoflash", dir);
+    } else if ((dir = getenv("HOME")) && *dir) {
+        snprintf(path, len, "%s/.cache", dir);
+        mkdir(path, 0755);
+        snprintf(path, len, "%s/.cache/dsoflash", dir);
+    } else {
+        return 0;
+    }
+    mkdir(path, 0755);
+    strncat(path, "/spi-clock", len - strlen(path) - 1);
+    return 1;
+}
+
+static int spi_clock_cache_load(const char *key, uint32_t *hz)
+{
+    char path[512], line[256], k[192];
+    unsigned long v;
+    int found = 0;
+    FILE *f;
+
+    if (!spi_clock_cache_path(path, sizeof (path)) || !(f = fopen(path, "r"))) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof (line), f)) {
+        if (sscanf(line, "%191s %lu", k, &v) == 2 && !strcmp(k, key)) {
+            *hz = v;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void spi_clock_cache_store(const char *key, uint32_t hz)
+{
+    char path[512], line[256], k[192];
+    char *lines = NULL;
+    size_t len = 0;
+    FILE *f;
+
+    if (!spi_clock_cache_path(path, sizeof (path))) {
+        return;
+    }
+    if ((f = fopen(path, "r"))) {                                           // Keep entries of other flash models
+        while (fgets(line, sizeof (line), f)) {
+            if (sscanf(line, "%191s", k) != 1 || !strcmp(k, key)) {
+                continue;
+            }
+            char *tmp = realloc(lines, len + strlen(line) + 1);
+            if (!tmp) {
+                break;
+            }
+            lines = tmp;
+            strcpy(lines + len, line);
+            len += strlen(line);
+        }
+        fclose(f);
+    }
+    if ((f = fopen(path, "w"))) {
+        if (lines) {
+            fputs(lines, f);
+        }
+        fprintf(f, "%s %u\n", key, hz);
+        fclose(f);
+    }
+    free(lines);
+}
+
+static void spi_clock_setup(void)
+{
+    uint32_t hz;
+
+    if (!spi_clock || clock_set) {
+        return;
+    }
+    clock_set = 1;
+
+    if (!strcmp(spi_clock, "auto") || !strcmp(spi_clock, "cached")) {
+        const char *key;                                                // Per flash model: the F1C100s has no
+        dsoflash_detect(dev);                                           // SID telling one scope from another
+        key = dsoflash_name(dev);
+
+        if (!strcmp(spi_clock, "cached") && spi_clock_cache_load(key, &hz)) {
+            hz = dsoflash_spi_clock(dev, hz);
+            printf("SPI clock: %.2f MHz (cached for %s)\n", hz / 1e6, key);
+            return;
+        }
+        if (dsoflash_calibrate(dev, &hz) != DSOFLASH_OK) {
+            printf("SPI clock calibration failed!\n");
+            terminal_error();
+        }
+        spi_clock_cache_store(key, hz);
+    } else {
+        char *end;
+        double mhz = strtod(spi_clock, &end);
+        if (*end || mhz <= 0) {
+            printf("Invalid SPI clock '%s'\n", spi_clock);
+            terminal_error();
+        }
+        hz = dsoflash_spi_clock(dev, (uint32_t)(mhz * 1e6));
+    }
+    printf("SPI clock: %.2f MHz\n", hz / 1e6);
+}
+
+static int parse_options(int argc, char *argv[])
+{
+    int n = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--spi-clock") && (i+1 < argc)) {
+            spi_clock = argv[++i];
+        } else if (!strncmp(argv[i], "--spi-clock=", 12)) {
+            spi_clock = argv[i] + 12;
+        } else if (!strcmp(argv[i], "--erase-chunk") && (i+1 < argc)) {
+            erase_chunk = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--blank-check")) {
+            blank_check = 1;
+        } else if (!strcmp(argv[i], "--sparse-read")) {
+            sparse_read = 1;
+        } else if (!strcmp(argv[i], "--trace") && (i+1 < argc)) {
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "--daemon") && (i+1 < argc)) {
+            daemon_path = argv[++i];
+        } else if (!strcmp(argv[i], "--store") && (i+1 < argc)) {
+            store_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--trace-md5")) {
+            trace_md5 = 1;
+        } else if (!strcmp(argv[i], "--destructive")) {
+            replay_destructive = 1;
+        } else if (!strncmp(argv[i], "--progress=jsonl", 16)) {
+            progress_fd = (argv[i][16] == ':') ? atoi(argv[i] + 17) : 2;
+        } else if (!strcmp(argv[i], "--stats") && (i+1 < argc) && !strncmp(argv[i+1], "json", 4)) {
+            const char *fmt = argv[++i];
+            stats_path = (fmt[4] == ':') ? fmt + 5 : NULL;
+            stats_enable();
+        } else {
+            argv[n++] = argv[i];
+        }
+    }
+    return n;
+}
+
+static void stats_report(void)
+{
+    FILE *f = stats_path ? fopen(stats_path, "w") : stdout;
+
+    if (!f) {
+        printf("Unable to write stats to %s!\n", stats_path);
+        return;
+    }
+    stats_report_json(f);
+    if (f != stdout) {
+        fclose(f);
+    }
+}
+
+void compute_md5(char *data, uint64_t len, char *digest)
 {
     struct UL_MD5Context md5_ctx;
     unsigned char d[UL_MD5LENGTH];
+    uint64_t t = stats_begin();
 
     ul_MD5Init(&md5_ctx);
-    ul_MD5Update(&md5_ctx, (uint8_t *)data, len);
+    for (uint64_t off = 0; off < len; off += MD5_CHUNK) {               // ul_MD5Update() takes an unsigned length
+        ul_MD5Update(&md5_ctx, (uint8_t *)data + off, (len - off) < MD5_CHUNK ? (len - off) : MD5_CHUNK);
+    }
     ul_MD5Final(d, &md5_ctx);
+    stats_end(STATS_HASH, t, len);
     sprintf(digest, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
             d[0],d[1],d[2],d[3],d[4],d[5],d[6],d[7],d[8],d[9],d[10],d[11],d[12],d[13],d[14],d[15]);
 
@@ -151,157 +369,614 @@ void process_filename(char *s)
     dot = strrchr(filename, '.');
     if (!dot) {
         dot = &filename[strlen(filename)];
-        strcpy(dot, ".bin");
+        strcpy(dot, store_dir ? ".manifest" : ".bin");
     }
     strcpy(ext, dot);
 }
 
 void show_elapsed(void)
 {
-    char time_str[100];
-    time_t elapsed = time(0) - start;
-    strftime(time_str, sizeof (time_str) - 1, "Elapsed time: %M:%S\n", gmtime(&elapsed));
-    printf("%s\n", time_str);
+    uint64_t ms = (trace_clock_ns() - start) / 1000000;
+    printf("Elapsed time: %02u:%02u.%03u\n\n", (unsigned)(ms / 60000), (unsigned)(ms / 1000 % 60), (unsigned)(ms % 1000));
 }
 
-int main(int argc, char *argv[])
+/*
+ * ECC outcome of a dump: counted for the report, and every page that had
+ * bit flips listed in <file>.ecc next to the .md5, by image offset.
+ */
+static void ecc_manifest(const uint8_t *status)
 {
-    if (argc < 2) {
-        usage();
+    static const char *names[] = {
+        [SPINAND_ECC_CORRECTED]     = "corrected",
+        [SPINAND_ECC_FAILED]        = "uncorrectable",
+        [SPINAND_ECC_CORRECTED_MAX] = "corrected-at-limit",
+    };
+    uint32_t pages = dsoflash_pages(dev);
+    uint32_t page_size = capacity / pages;
+    uint32_t corrected = 0, failed = 0;
+    FILE *f;
+
+    for (uint32_t p = 0; p < pages; p++) {
+        corrected += SPINAND_ECCS(status[p]) == SPINAND_ECC_CORRECTED || SPINAND_ECCS(status[p]) == SPINAND_ECC_CORRECTED_MAX;
+        failed += SPINAND_ECCS(status[p]) == SPINAND_ECC_FAILED;
+    }
+    report_ecc(pages, corrected, failed);
+
+    strcpy(dot, ".ecc");
+    if (!(f = fopen(filename, "w"))) {
+        printf("Unable to write file %s!\n", filename);
+    } else {
+        fprintf(f, "# %u pages, %u corrected, %u uncorrectable\n", pages, corrected, failed);
+        for (uint32_t p = 0; p < pages; p++) {
+            if (SPINAND_ECCS(status[p]) != SPINAND_ECC_OK) {
+                fprintf(f, "0x%09llx %s\n", (unsigned long long)p*page_size, names[SPINAND_ECCS(status[p])]);
+            }
+        }
+        fclose(f);
+    }
+    if (failed) {
+        printf("WARNING: %u pages failed ECC, their data is not reliable, see %s\n", failed, filename);
+    } else if (corrected) {
+        printf("ECC: %u pages had bit flips, all corrected, see %s\n", corrected, filename);
+    }
+}
+
+// ECC outcome of every page as a histogram, then the blocks that had bit flips
+static void health_report(void)
+{
+    static const char *names[] = {
+        [SPINAND_ECC_OK]            = "No bit flips",
+        [SPINAND_ECC_CORRECTED]     = "Corrected",
+        [SPINAND_ECC_FAILED]        = "Uncorrectable",
+        [SPINAND_ECC_CORRECTED_MAX] = "Corrected at limit",
+    };
+    const struct spinand_info_t *info = spinand_info_find(dsoflash_name(dev));
+    uint32_t pages = dsoflash_pages(dev);
+    uint32_t ppb = info->pages_per_block;
+    uint32_t hist[4] = { 0 };
+    uint8_t *status = malloc(pages);
+    int err;
+
+    if (!status) {
+        printf("Unable to allocate status buffer!\n");
+        terminal_error();
+    }
+    start = trace_clock_ns();
+    if ((err = dsoflash_health(dev, status, pages)) != DSOFLASH_OK) {
+        printf("Health check failed: %s\n", dsoflash_strerror(err));
+        free(status);
+        terminal_error();
+    }
+
+    printf("\nBlocks with bit flips:\n");
+    for (uint32_t block = 0; block < pages / ppb; block++) {
+        uint32_t n[4] = { 0 };
+        for (uint32_t p = block*ppb; p < (block + 1)*ppb; p++) {
+            n[SPINAND_ECCS(status[p])]++;
+        }
+        for (int i = 0; i < 4; i++) {
+            hist[i] += n[i];
+        }
+        if (n[SPINAND_ECC_OK] != ppb) {
+            printf("  %5u at 0x%09llx: %u corrected, %u at limit, %u uncorrectable\n", block,
+                   (unsigned long long)block*ppb*info->page_size, n[SPINAND_ECC_CORRECTED],
+                   n[SPINAND_ECC_CORRECTED_MAX], n[SPINAND_ECC_FAILED]);
+        }
+    }
+    printf("\nPages by ECC status:\n");
+    for (int i = 0; i < 4; i++) {
+        printf("  %-20s %9u\n", names[i], hist[i]);
+    }
+    printf("\n");
+    free(status);
+    show_elapsed();
+}
+
+static int absolute_path(char *abs, size_t len, const char *path)
+{
+    char cwd[PATH_MAX];
+    int n;
+
+    if (path[0] == '/' || !getcwd(cwd, sizeof (cwd))) {
+        n = snprintf(abs, len, "%s", path);
+    } else {
+        n = snprintf(abs, len, "%s/%s", cwd, path);
+    }
+    if (n < 0 || (size_t)n >= len) {
+        printf("ERROR: Path too long: %s\n", path);
         return 0;
     }
-    argc--;
-    argv++;
-    for (int i = 1; i < argc; i++) {
-        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-            usage();
-            return 0;
+    return 1;
+}
+
+// Send one command to dsoflashd and draw its progress; result gets what follows "ok"
+static int daemon_request(FILE *in, FILE *out, const char *cmd, char *result, size_t len)
+{
+    char line[DSOFLASHD_LINE_MAX], phase[32] = "", name[32];
+    unsigned long long done, total;
+    struct report_t r;
+
+    fprintf(out, "%s\n", cmd);
+    fflush(out);
+    while (fgets(line, sizeof (line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "progress %31s %llu %llu", name, &done, &total) == 3) {
+            if (strcmp(name, phase) || done < r.done) {                     // A new phase, maybe of the same name
+                if (phase[0]) {
+                    report_stop(&r);
+                }
+                strcpy(phase, name);
+                report_start(&r, phase, total, NULL, NULL);
+            }
+            report_update(&r, done - r.done);
+            continue;
+        }
+        if (phase[0]) {
+            report_stop(&r);
+        }
+        if (!strncmp(line, "ok", 2)) {
+            int n = result ? snprintf(result, len, "%s", line[2] ? line + 3 : "") : 0;
+            if (result && (n < 0 || (size_t)n >= len)) {
+                printf("ERROR: Reply of dsoflashd too long: %s\n", line);
+                return 0;
+            }
+            return 1;
         }
+        printf("ERROR: %s\n", strncmp(line, "error ", 6) ? line : line + 6);
+        return 0;
+    }
+    if (phase[0]) {
+        report_stop(&r);
     }
-    libusb_init(NULL);
-    ctx.hdl = libusb_open_device_with_vid_pid(NULL, 0x1f3a, 0xefe8);
-    if (ctx.hdl == NULL) {
-        printf("ERROR: No USB device found\n");
-        libusb_exit(NULL);
+    printf("ERROR: dsoflashd closed the connection\n");
+    return 0;
+}
+
+static int daemon_client(int argc, char *argv[])
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char cmd[DSOFLASHD_LINE_MAX], result[256], path[PATH_MAX];
+    FILE *in, *out;
+    int fd, ok;
+
+    if (store_dir) {
+        printf("ERROR: --store can't be used through dsoflashd\n");
+        return -1;
+    }
+    if ((size_t)snprintf(addr.sun_path, sizeof (addr.sun_path), "%s", daemon_path) >= sizeof (addr.sun_path)) {
+        printf("ERROR: Socket path too long: %s\n", daemon_path);
         return -1;
     }
-    if (!fel_init(&ctx)) {
-        printf("ERROR: No FEL device found\n");
-        libusb_exit(NULL);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof (addr))) {
+        printf("ERROR: Unable to reach dsoflashd on %s\n", daemon_path);
         return -1;
     }
+    in = fdopen(fd, "r");
+    out = fdopen(dup(fd), "w");
+    if (!in || !out) {
+        printf("ERROR: Unable to reach dsoflashd on %s\n", daemon_path);
+        return -1;
+    }
+
+    snprintf(cmd, sizeof (cmd), "set blank-check %d", blank_check);         // Options last for the daemon's lifetime
+    ok = daemon_request(in, out, cmd, NULL, 0);
+    snprintf(cmd, sizeof (cmd), "set erase-chunk %u", erase_chunk);
+    ok = ok && daemon_request(in, out, cmd, NULL, 0);
+    snprintf(cmd, sizeof (cmd), "set sparse-read %d", sparse_read);
+    ok = ok && daemon_request(in, out, cmd, NULL, 0);
+    if (ok && spi_clock) {
+        snprintf(cmd, sizeof (cmd), "set spi-clock %s", spi_clock);
+        ok = daemon_request(in, out, cmd, NULL, 0);
+    }
+
+    start = trace_clock_ns();
+    if (!ok) {
+        // Already reported
+    } else if (!strcmp(argv[0], "ver") || !strcmp(argv[0], "detect") || !strcmp(argv[0], "erase") ||
+               !strcmp(argv[0], "reset")) {
+        if ((ok = daemon_request(in, out, argv[0], result, sizeof (result))) && result[0]) {
+            char name[128];
+            unsigned long long size;
+            if (!strcmp(argv[0], "detect") && sscanf(result, "%127s %llu", name, &size) == 2) {
+                printf("Flash found: '%s'  Size: %llu MB\n", name, size/(1024*1024));
+            } else {
+                printf("%s\n", result);
+            }
+        }
+    } else if (!strcmp(argv[0], "read") && (argc == 2)) {
+        process_filename(argv[1]);
+        ok = absolute_path(path, sizeof (path), filename);
+        snprintf(cmd, sizeof (cmd), "read %s", path);                   // cmd has room for any path
+        if (ok && (ok = daemon_request(in, out, cmd, result, sizeof (result)))) {
+            printf("\nFlash saved to %s\n", filename);
+            strcpy(dot, ".md5");
+            report_digest("flash", result);
+            if (!file_save(filename, result, 33)) {
+                printf("Unable to write file %s!\n\nMD5: %s\n", filename, result);
+            } else {
+                printf("%s\n\nMD5: %s\n", filename, result);
+            }
+            show_elapsed();
+        }
+    } else if (!strcmp(argv[0], "write") && (argc == 2)) {
+        process_filename(argv[1]);
+        strcpy(dot, ".md5");
+        char *file_md5 = file_load(filename, &read_bytes);
+        if (file_md5 != NULL && read_bytes != 33) {
+            printf("Bad MD5 filesize, must be 33 Bytes!\n");
+            ok = 0;
+        } else {
+            if (file_md5) {
+                file_md5[32] = '\0';
+            }
+            ok = absolute_path(path, sizeof (path), argv[1]);
+            snprintf(cmd, sizeof (cmd), "write %s %s", file_md5 ? file_md5 : "-", path);
+            if (ok && (ok = daemon_request(in, out, cmd, result, sizeof (result)))) {
+                report_digest("file", result);
+                printf("MD5%s: %s\n", file_md5 ? " OK" : "", result);
+                printf("\nFlash written sucessfully from file %s\n", argv[1]);
+                show_elapsed();
+            }
+        }
+        free(file_md5);
+    } else {
+        printf("'%s' can't be run through dsoflashd\n", argv[0]);
+        ok = 0;
+    }
+
+    fclose(out);
+    fclose(in);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Image for write, loaded on a thread of its own while the flash erases.
+ * Its size and .md5 are checked before, so a missing or mistyped file never
+ * gets the flash erased; the md5 itself has to wait for the whole image.
+ */
+struct image_job_t {
+    const char *path;                           // Image file, or manifest with --store
+    uint64_t len;                               // Expected, spare area included
+    size_t spare;                               // Bytes after every 2048 of data in old backups
+    char md5[33];                               // Computed, or as the manifest recorded it
+    int ok;
+};
+
+static void * image_load(void *arg)
+{
+    struct image_job_t *job = arg;
+    uint64_t len = 0;
+
+    if (store_dir) {
+        filebf = store_load(store_dir, job->path, &len, job->md5);     // Chunks checked, md5 as recorded
+    } else {
+        filebf = file_load(job->path, &len);
+    }
+    job->ok = filebf && len == job->len;                                // It may have changed since the stat()
+    if (job->ok && !store_dir) {
+        compute_md5(filebf, capacity, job->md5);
+    }
+    if (job->ok && job->spare) {
+        char *in = filebf, *out = filebf;                               // Extract data in place, out never passes in
+        for (uint64_t i = 0; i < capacity / 2048; i++) {
+            memmove(out, in, 2048);
+            in += 2048+job->spare;
+            out += 2048;
+        }
+    }
+    return NULL;
+}
+
+// One verb and its arguments, on the device opened by main(); 0 if unknown
+static int command(int argc, char *argv[])
+{
+    struct xfel_ctx_t *ctx = dsoflash_ctx(dev);
+    int err;
+
     if (!strcmp(argv[0], "ver")) {
         printf("%.8s ID=0x%08x(%s) dflag=0x%02x dlength=0x%02x scratchpad=0x%08x\n",
-               ctx.version.magic, ctx.version.id, ctx.chip->name, ctx.version.dflag,
-               ctx.version.dlength, ctx.version.scratchpad);
+               ctx->version.magic, ctx->version.id, ctx->chip->name, ctx->version.dflag,
+               ctx->version.dlength, ctx->version.scratchpad);
     } else if (!strcmp(argv[0], "detect") && (argc == 1)) {
         init_system();
+        spi_clock_setup();
     } else if (!strcmp(argv[0], "status") && (argc == 1)) {
-        dso2d_dump_regs(&ctx);
+        spi_clock_setup();
+        dso2d_dump_regs(ctx);
     } else if (!strcmp(argv[0], "reset")) {
-        fel_chip_reset(&ctx);
+        dsoflash_reset(dev);
+        session_reset();
     } else if (!strcmp(argv[0], "erase") && (argc == 1)) {
-        dso2d_erase(&ctx);
+        spi_clock_setup();
+        dsoflash_erase(dev);
+    } else if (!strcmp(argv[0], "health") && (argc == 1)) {
+        init_system();
+        spi_clock_setup();
+        health_report();
+    } else if (!strcmp(argv[0], "replay") && (argc == 2)) {
+        if (!trace_replay(ctx, argv[1], replay_destructive, usb_hs_mode, dev)) {
+            terminal_error();
+        }
     } else if (!strcmp(argv[0], "read") && (argc == 2)) {
         init_system();
+        spi_clock_setup();
         process_filename(argv[1]);
         flashbf = malloc(capacity);
-        if (!flashbf) {
+        uint8_t *ecc = malloc(dsoflash_pages(dev));
+        if (!flashbf || !ecc) {
             printf("Unable to allocate flash buffer!\n");
+            free(ecc);
+            terminal_error();
+        }
+        dsoflash_set_ecc_capture(dev, ecc, dsoflash_pages(dev));
+        start = trace_clock_ns();
+        err = dsoflash_read_buf(dev, flashbf, capacity);
+        dsoflash_set_ecc_capture(dev, NULL, 0);
+        if (err != DSOFLASH_OK) {
+            printf("Reading flash failed: %s\n", dsoflash_strerror(err));
+            free(ecc);
             terminal_error();
         }
-        start = time(0);
-        dso2d_dump(&ctx, flashbf);
-        if (!file_save(filename, flashbf, capacity)) {
+        char data_md5[33];
+        if (store_dir) {
+            struct store_stats_t st;
+            const struct spinand_info_t *info = spinand_info_find(dsoflash_name(dev));
+            if (!store_save(store_dir, filename, dsoflash_name(dev), flashbf, capacity,
+                            info->page_size * info->pages_per_block, data_md5, &st)) {
+                printf("Unable to save flash to store %s!\n", store_dir);
+                terminal_error();
+            }
+            printf("\nFlash saved to %s\n%u blocks in %s, %u new (%llu KiB)\n\nMD5: %s\n", filename, st.blocks,
+                   store_dir, st.new_blocks, (unsigned long long)st.new_bytes / 1024, data_md5);
+            report_digest("flash", data_md5);
+        } else if (!file_save(filename, flashbf, capacity)) {
             printf("Unable to write to file %s!\n", filename);
             terminal_error();
         } else {
-            char data_md5[33];
             printf("\nFlash saved to %s\n", filename);
             strcpy(dot, ".md5");
             compute_md5(flashbf, capacity, data_md5);
+            report_digest("flash", data_md5);
             if (!file_save(filename, data_md5, sizeof (data_md5))) {
                 printf("Unable to write file %s!\n\nMD5: %s\n", filename, data_md5);
             } else {
                 printf("%s\n\nMD5: %s\n", filename, data_md5);
             }
-            show_elapsed();
-            free(flashbf);
         }
-    } else if (!strcmp(argv[0], "write") && (argc == 2)) {
+        ecc_manifest(ecc);
+        show_elapsed();
+        free(flashbf);
+        flashbf = NULL;
+        free(ecc);
+    } else if (!strcmp(argv[0], "verify") && (argc == 2)) {
         init_system();
-
-        char data_md5[33];
-        process_filename(argv[1]);
-        strcpy(dot, ".md5");
-        char *file_md5 = file_load(filename, &read_bytes);
-        if (file_md5 != NULL && read_bytes != 33) {
-            printf("Bad MD5 filesize, must be 33 Bytes!\n");
+        spi_clock_setup();
+        if (store_dir) {
+            process_filename(argv[1]);
+            if (!(filebf = store_load(store_dir, filename, &read_bytes, NULL))) {
+                terminal_error();
+            }
+        } else if (!(filebf = file_load(argv[1], &read_bytes))) {
+            printf("Unable to read from file %s!\n", argv[1]);
             terminal_error();
         }
-
-        filebf = file_load(argv[1], &read_bytes);
-        if (!filebf) {
-            printf("Unable to read from file %s!\n", argv[1]);
+        if (read_bytes != capacity) {
+            printf("File doesn't match the flash size\n");
+            printf(" Flash: %llu Bytes,   File: %llu Bytes\n", (unsigned long long)capacity, (unsigned long long)read_bytes);
+            terminal_error();
+        }
+        flashbf = malloc(capacity);
+        if (!flashbf) {
+            printf("Unable to allocate flash buffer!\n");
+            terminal_error();
+        }
+        start = trace_clock_ns();
+        if ((err = dsoflash_read_buf(dev, flashbf, capacity)) != DSOFLASH_OK) {
+            printf("Reading flash failed: %s\n", dsoflash_strerror(err));
+            terminal_error();
+        }
+        uint64_t first = 0, diff = 0;
+        for (uint64_t i = 0; i < capacity; i++) {
+            if (flashbf[i] != filebf[i] && !diff++) {
+                first = i;
+            }
+        }
+        free(flashbf);
+        free(filebf);
+        flashbf = filebf = NULL;
+        if (diff) {
+            printf("\nFlash differs from %s in %llu bytes, first at 0x%08llx\n", argv[1],
+                   (unsigned long long)diff, (unsigned long long)first);
             terminal_error();
         }
+        printf("\nFlash matches %s\n", argv[1]);
+        show_elapsed();
+    } else if (!strcmp(argv[0], "write") && (argc == 2)) {
+        init_system();
+        spi_clock_setup();
 
-        compute_md5(filebf, capacity, data_md5);
+        struct image_job_t job = { .path = argv[1] };
+        char file_md5[33] = "";                                 // Empty if there is none
+        struct stat st;
+        process_filename(argv[1]);
+        if (store_dir) {
+            job.path = filename;
+            if (!store_manifest(filename, &read_bytes, file_md5)) {
+                terminal_error();
+            }
+        } else {
+            strcpy(dot, ".md5");
+            char *md5 = file_load(filename, &read_bytes);
+            if (md5 != NULL && read_bytes != 33) {
+                printf("Bad MD5 filesize, must be 33 Bytes!\n");
+                terminal_error();
+            }
+            if (md5) {
+                memcpy(file_md5, md5, 32);
+                free(md5);
+            }
+            if (stat(argv[1], &st)) {
+                printf("Unable to read from file %s!\n", argv[1]);
+                terminal_error();
+            }
+            read_bytes = st.st_size;
+        }
 
+        uint64_t pages = capacity / 2048;
         if (read_bytes != capacity) {                          // capacity not matching flash size
-            size_t spare;                             // Check  if filesize matches data+spare
-            if (read_bytes == ((size_t)132*1024*1024)) {                // 64 byte spare area
-                spare = 64;
-            } else if (read_bytes == ((size_t)136*1024*1024)) {      // 128 byte spare area
-                spare = 128;
-            } else if (read_bytes == ((size_t)144*1024*1024)) {      // 256 byte spare area
-                spare = 256;
+            if (read_bytes == capacity + pages*64) {            // Check if filesize matches data+spare, 64 byte spare area
+                job.spare = 64;
+            } else if (read_bytes == capacity + pages*128) {    // 128 byte spare area
+                job.spare = 128;
+            } else if (read_bytes == capacity + pages*256) {    // 256 byte spare area
+                job.spare = 256;
             } else {
                 printf("File doesn't match the flash size\n");
-                printf(" Flash: %zu Bytes,   File: %zu Bytes\n", read_bytes, capacity);
+                printf(" Flash: %llu Bytes,   File: %llu Bytes\n", (unsigned long long)capacity, (unsigned long long)read_bytes);
                 terminal_error();
             }
+            printf("Old backup detected, spare area: %zuBytes\n\n", job.spare);
+        }
+        job.len = read_bytes;
 
-            printf("Old backup detected, spare area: %zuBytes\n\n", spare);
-
-            char *tmp = malloc(read_bytes);                       // Temporal buffer
-            if (tmp == NULL) {
-                printf("Unable to allocate flash buffer!\n");
-                terminal_error();
-            }
-            char *in = filebf, *out = tmp;
-            for (size_t i = 0; i < read_bytes; i += (2048+spare)) {        // Extract data
-                memcpy(out, in, 2048);
-                in += 2048+spare;
-                out += 2048;
-            }
-            memcpy(filebf,tmp,capacity);                        // Copy data
-            free(tmp);
+        pthread_t loader;
+        int threaded = !pthread_create(&loader, NULL, image_load, &job);   // Image loads while the flash erases
+        if (!threaded) {
+            image_load(&job);
+        }
+        start = trace_clock_ns();
+        err = (threaded || job.ok) ? dsoflash_erase(dev) : DSOFLASH_OK;
+        if (threaded) {
+            pthread_join(loader, NULL);
+        }
+        if (!job.ok) {
+            printf("Unable to read from file %s!\n", job.path);
+            terminal_error();
+        }
+        if (err != DSOFLASH_OK) {
+            printf("Erasing flash failed: %s\n", dsoflash_strerror(err));
+            terminal_error();
         }
 
-        if (!file_md5) {
-            printf("MD5: %s\nFile %s not found, skipping md5 check\n", data_md5, filename);
-        } else if (strcmp(data_md5, file_md5) != 0) {
-            printf("MD5 mismatch! Aborting...\n\n%s: %s\nComputed: %s\n\n", filename, file_md5, data_md5);
+        if (!file_md5[0]) {
+            printf("MD5: %s\nFile %s not found, skipping md5 check\n", job.md5, filename);
+        } else if (strcmp(job.md5, file_md5) != 0) {
+            printf("MD5 mismatch! Aborting, the flash is erased but not written\n\n%s: %s\nComputed: %s\n\n",
+                   filename, file_md5, job.md5);
             printf("You might delete or rename the md5 file to skip md5 check\n");
             terminal_error();
         } else {
-            printf("MD5 OK: %s\n", data_md5);
-        }
-        if (file_md5) {
-            free(file_md5);
+            printf("MD5 OK: %s\n", job.md5);
         }
+        report_digest("file", job.md5);
 
-        start = time(0);
-        dso2d_restore(&ctx, filebf);
+        if ((err = dsoflash_program_buf(dev, filebf, capacity)) != DSOFLASH_OK) {
+            printf("Writing flash failed: %s\n", dsoflash_strerror(err));
+            terminal_error();
+        }
         printf("\nFlash written sucessfully from file %s\n", argv[1]);
         show_elapsed();
         free(filebf);
+        filebf = NULL;
     } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Steps of a job, one per line or separated by ';', '#' starts a comment:
+ * each is a verb as on the command line, all run on one device session.
+ */
+static int run_job(const char *path)
+{
+    char line[1024], *save, *step;
+    FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    int n = 0, ok = 1, reset = 0;
+
+    if (!f) {
+        printf("Unable to read job file %s!\n", path);
+        return 0;
+    }
+    while (ok && fgets(line, sizeof (line), f)) {
+        n++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        for (step = strtok_r(line, ";", &save); ok && step; step = strtok_r(NULL, ";", &save)) {
+            char *argv[3], *save2;
+            int argc = 0;
+            for (char *w = strtok_r(step, " \t", &save2); w; w = strtok_r(NULL, " \t", &save2)) {
+                if (argc == 3) {
+                    argc = -1;                                  // No verb takes that many arguments
+                    break;
+                }
+                argv[argc++] = w;
+            }
+            if (!argc) {
+                continue;
+            }
+            if (reset) {
+                printf("%s:%d: device was reset, stopping before '%s'\n", path, n, argv[0]);
+                ok = 0;
+            } else if (argc < 0 || !strcmp(argv[0], "run") || !command(argc, argv)) {
+                printf("%s:%d: bad step '%s'\n", path, n, argv[0]);
+                ok = 0;
+            }
+            reset = !strcmp(argv[0], "reset");
+        }
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
         usage();
+        return 0;
     }
+    argc--;
+    argv++;
+    argc = parse_options(argc, argv);
+    if (argc < 1) {
+        usage();
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage();
+            return 0;
+        }
+    }
+    if (progress_fd >= 0 && !report_jsonl(progress_fd)) {
+        return -1;
+    }
+    if (stats_enabled()) {
+        atexit(stats_report);
+    }
+    if (daemon_path) {
+        return daemon_client(argc, argv);
+    }
+    if (trace_path && !trace_open(trace_path, trace_md5)) {
+        return -1;
+    }
+    trace_phase("init");
+    int err = dsoflash_open(&dev, NULL);
+    if (err != DSOFLASH_OK) {
+        printf("ERROR: %s\n", dsoflash_strerror(err));
+        return -1;
+    }
+    dsoflash_set_erase_chunk(dev, erase_chunk);
+    dsoflash_set_blank_check(dev, blank_check);
+    dsoflash_set_sparse_read(dev, sparse_read);
 
-    libusb_close(ctx.hdl);
-    libusb_exit(NULL);
-    return 0;
+    if (!strcmp(argv[0], "run") && (argc == 2)) {
+        err = run_job(argv[1]) ? 0 : -1;
+    } else if (!command(argc, argv)) {
+        usage();
+    }
+
+    dsoflash_close(dev);
+    return err;
 }
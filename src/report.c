@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include "report.h"
+#include "trace.h"
+
+static FILE *jsonl;
+static uint64_t t0;                             // Event times are relative to report_jsonl()
+
+
+static double report_s(uint64_t ns)
+{
+    return ns / 1e9;
+}
+
+int report_jsonl(int fd)
+{
+    if (!(jsonl = fdopen(fd, "w"))) {
+        printf("Unable to open file descriptor %d for progress events!\n", fd);
+        return 0;
+    }
+    t0 = trace_clock_ns();
+    return 1;
+}
+
+void report_start(struct report_t *r, const char *phase, uint64_t total, report_fn_t fn, void *user)
+{
+    r->fn = fn;
+    r->user = user;
+    r->phase = phase;
+    r->total = total;
+    r->done = 0;
+    r->begin = r->last = trace_clock_ns();
+    r->last_done = 0;
+    trace_phase(phase);
+
+    if (fn) {
+        fn(user, phase, 0, total);
+        return;
+    }
+    if (!jsonl) {
+        progress_start(&r->bar, total);
+        return;
+    }
+    fprintf(jsonl, "{\"event\":\"phase\",\"phase\":\"%s\",\"total\":%llu,\"t\":%.3f}\n",
+            phase, (unsigned long long)total, report_s(r->begin - t0));
+    fflush(jsonl);
+}
+
+void report_update(struct report_t *r, uint64_t bytes)
+{
+    uint64_t now;
+
+    r->done += bytes;
+    if (!r->fn && !jsonl) {
+        progress_update(&r->bar, bytes);
+        return;
+    }
+    now = trace_clock_ns();
+    if (now - r->last < REPORT_INTERVAL_MS*1000000ULL) {
+        return;
+    }
+    if (r->fn) {
+        r->fn(r->user, r->phase, r->done, r->total);
+        r->last = now;
+        return;
+    }
+
+    double rate = (r->done - r->last_done) / report_s(now - r->last);
+    double avg = r->done / report_s(now - r->begin);
+    double eta = (avg > 0) ? (r->total - r->done) / avg : 0;
+    fprintf(jsonl, "{\"event\":\"progress\",\"phase\":\"%s\",\"done\":%llu,\"total\":%llu,"
+            "\"rate\":%.0f,\"avg\":%.0f,\"eta\":%.1f,\"t\":%.3f}\n",
+            r->phase, (unsigned long long)r->done, (unsigned long long)r->total, rate, avg, eta, report_s(now - t0));
+    fflush(jsonl);
+    r->last = now;
+    r->last_done = r->done;
+}
+
+void report_stop(struct report_t *r)
+{
+    uint64_t now;
+
+    if (r->fn) {
+        r->fn(r->user, r->phase, r->done, r->total);
+        return;
+    }
+    if (!jsonl) {
+        progress_stop(&r->bar);
+        return;
+    }
+    now = trace_clock_ns();
+    fprintf(jsonl, "{\"event\":\"phase_end\",\"phase\":\"%s\",\"done\":%llu,\"s\":%.3f,\"avg\":%.0f,\"t\":%.3f}\n",
+            r->phase, (unsigned long long)r->done, report_s(now - r->begin),
+            (now > r->begin) ? r->done / report_s(now - r->begin) : 0, report_s(now - t0));
+    fflush(jsonl);
+}
+
+void report_retry(const char *what, uint32_t count)
+{
+    if (jsonl) {
+        fprintf(jsonl, "{\"event\":\"retry\",\"what\":\"%s\",\"count\":%u,\"t\":%.3f}\n",
+                what, count, report_s(trace_clock_ns() - t0));
+        fflush(jsonl);
+    }
+}
+
+void report_digest(const char *name, const char *md5)
+{
+    if (jsonl) {
+        fprintf(jsonl, "{\"event\":\"digest\",\"name\":\"%s\",\"md5\":\"%s\",\"t\":%.3f}\n",
+                name, md5, report_s(trace_clock_ns() - t0));
+        fflush(jsonl);
+    }
+}
+
+void report_ecc(uint32_t pages, uint32_t corrected, uint32_t uncorrectable)
+{
+    if (jsonl) {
+        fprintf(jsonl, "{\"event\":\"ecc\",\"pages\":%u,\"corrected\":%u,\"uncorrectable\":%u,\"t\":%.3f}\n",
+                pages, corrected, uncorrectable, report_s(trace_clock_ns() - t0));
+        fflush(jsonl);
+    }
+}
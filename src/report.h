@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef REPORT_H_
+#define REPORT_H_
+
+#include <fel.h>
+
+/*
+ * Progress of a phase (erase, read, ...): xfel's terminal bar, or after
+ * report_jsonl() one JSON object per line on a file descriptor, for a
+ * controller driving many flashes:
+ *
+ *   {"event":"phase","phase":"write","total":134217728,"t":2.137}
+ *   {"event":"progress","phase":"write","done":...,"total":...,"rate":...,"avg":...,"eta":...,"t":...}
+ *   {"event":"phase_end","phase":"write","done":...,"s":...,"avg":...,"t":...}
+ *   {"event":"retry","what":"usb-reopen","count":1,"t":...}
+ *   {"event":"digest","name":"file","md5":"...","t":...}
+ *   {"event":"ecc","pages":65536,"corrected":2,"uncorrectable":0,"t":...}
+ *
+ * Rates are in bytes/s, t and ETA in seconds. Progress events go out at
+ * most every REPORT_INTERVAL_MS, checking costs one clock read per update.
+ * A phase started with a callback reports only to it, as often as events.
+ */
+#define REPORT_INTERVAL_MS  (250U)
+
+typedef void (*report_fn_t)(void *user, const char *phase, uint64_t done, uint64_t total);
+
+struct report_t {
+    struct progress_t bar;
+    report_fn_t fn;
+    void *user;
+    const char *phase;
+    uint64_t total, done;
+    uint64_t begin;
+    uint64_t last, last_done;                   // Previous progress event
+};
+
+int report_jsonl(int fd);
+
+void report_start(struct report_t *r, const char *phase, uint64_t total, report_fn_t fn, void *user);
+void report_update(struct report_t *r, uint64_t bytes);
+void report_stop(struct report_t *r);
+
+void report_retry(const char *what, uint32_t count);
+void report_digest(const char *name, const char *md5);
+void report_ecc(uint32_t pages, uint32_t corrected, uint32_t uncorrectable);
+
+#endif // REPORT_H_
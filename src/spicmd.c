@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include "spicmd.h"
+#include "f1c100s_f1c200s_f1c500s.h"
+
+#define DELTA_RANGE_COST    (4096U)         // Bytes worth of USB time one extra fel_write costs
+
+
+static void put(struct spicmd_t *s, const void *data, uint32_t len)
+{
+    if (s->overflow || len > s->size - s->len) {
+        s->overflow = 1;
+        return;
+    }
+    memcpy(&s->buf[s->len], data, len);
+    s->len += len;
+}
+
+static void put8(struct spicmd_t *s, uint8_t v)
+{
+    put(s, &v, 1);
+}
+
+static void put_le32(struct spicmd_t *s, uint32_t v)
+{
+    uint8_t b[4] = { v & 0xFF, (v>>8) & 0xFF, (v>>16) & 0xFF, (v>>24) & 0xFF };
+    put(s, b, 4);
+}
+
+int spicmd_init(struct spicmd_t *s, uint32_t size)
+{
+    memset(s, 0, sizeof (*s));
+    s->buf = malloc(size);
+    s->dev = malloc(size);
+    s->size = size;
+    if (!s->buf || !s->dev) {
+        spicmd_free(s);
+        return 0;
+    }
+    return 1;
+}
+
+void spicmd_free(struct spicmd_t *s)
+{
+    free(s->buf);
+    free(s->dev);
+    s->buf = s->dev = NULL;
+    s->size = 0;
+}
+
+void spicmd_reset(struct spicmd_t *s)
+{
+    s->len = 0;
+    s->overflow = 0;
+}
+
+/*
+ * Replace the stream in dst with the one in src, keeping what dst knows of
+ * the device. Lets streams be built elsewhere but sent through one builder.
+ */
+int spicmd_copy(struct spicmd_t *dst, const struct spicmd_t *src)
+{
+    spicmd_reset(dst);
+    put(dst, src->buf, src->len);
+    dst->overflow |= src->overflow;
+    return !dst->overflow;
+}
+
+void spicmd_select(struct spicmd_t *s)
+{
+    put8(s, SPI_CMD_SELECT);
+}
+
+void spicmd_deselect(struct spicmd_t *s)
+{
+    put8(s, SPI_CMD_DESELECT);
+}
+
+uint32_t spicmd_fast(struct spicmd_t *s, const uint8_t *tx, uint8_t len)
+{
+    put8(s, SPI_CMD_FAST);
+    put8(s, len);
+    put(s, tx, len);
+    return s->len - len;
+}
+
+uint32_t spicmd_txbuf(struct spicmd_t *s, uint32_t addr, uint32_t len)
+{
+    put8(s, SPI_CMD_TXBUF);
+    put_le32(s, addr);
+    put_le32(s, len);
+    return s->len - 8;
+}
+
+uint32_t spicmd_rxbuf(struct spicmd_t *s, uint32_t addr, uint32_t len)
+{
+    put8(s, SPI_CMD_RXBUF);
+    put_le32(s, addr);
+    put_le32(s, len);
+    return s->len - 8;
+}
+
+void spicmd_spinand_wait(struct spicmd_t *s)
+{
+    put8(s, SPI_CMD_SELECT);
+    put8(s, SPI_CMD_SPINAND_WAIT);
+    put8(s, SPI_CMD_DESELECT);
+}
+
+/*
+ * Open a loop of count passes with nfields fields; returns the offset of the
+ * body, which the fields are relative to. Fill every field with
+ * spicmd_loop_field() before spicmd_next().
+ */
+uint32_t spicmd_loop(struct spicmd_t *s, uint32_t count, uint8_t nfields)
+{
+    put8(s, SPI_CMD_LOOP);
+    put_le32(s, count);
+    put8(s, nfields);
+    s->loop_field = s->len;
+    for (uint32_t i = 0; i < nfields*SPI_LOOP_FIELD_SZ; i++) {
+        put8(s, 0);
+    }
+    return s->len;
+}
+
+void spicmd_loop_field(struct spicmd_t *s, uint32_t body, uint32_t at, uint8_t flags, uint32_t stride)
+{
+    uint32_t offset = at - body;
+    uint8_t *f = &s->buf[s->loop_field];
+
+    if (s->overflow || s->loop_field + SPI_LOOP_FIELD_SZ > body) {
+        s->overflow = 1;
+        return;
+    }
+    f[0] = (offset>>0) & 0xFF;
+    f[1] = (offset>>8) & 0xFF;
+    f[2] = flags;
+    f[3] = (stride>>0)  & 0xFF;
+    f[4] = (stride>>8)  & 0xFF;
+    f[5] = (stride>>16) & 0xFF;
+    f[6] = (stride>>24) & 0xFF;
+    s->loop_field += SPI_LOOP_FIELD_SZ;
+}
+
+void spicmd_next(struct spicmd_t *s)
+{
+    put8(s, SPI_CMD_NEXT);
+}
+
+// And the len bytes at addr into the byte at result; returns the offset of result
+uint32_t spicmd_checkff(struct spicmd_t *s, uint32_t addr, uint32_t len, uint32_t result)
+{
+    put8(s, SPI_CMD_CHECKFF);
+    put_le32(s, addr);
+    put_le32(s, len);
+    put_le32(s, result);
+    return s->len - 4;
+}
+
+void spicmd_end(struct spicmd_t *s)
+{
+    put8(s, SPI_CMD_END);
+}
+
+/*
+ * Upload what changed since the last run. Differing ranges
+ * closer than DELTA_RANGE_COST are merged, one fel_write each.
+ */
+static int spicmd_upload(struct xfel_ctx_t *ctx, struct spicmd_t *s)
+{
+    if (s->overflow) {
+        printf("SPI command stream overflow (%u bytes)\n", s->size);
+        return 0;
+    }
+
+    uint32_t known = (s->dev_gen == f1c100s_spi_cmdbuf_gen(ctx)) ? s->dev_len : 0;
+    uint32_t pos = 0;
+
+    if (known > s->len) {
+        known = s->len;
+    }
+
+    while (pos < s->len) {
+        uint32_t start = pos, end;
+
+        while (start < known && s->buf[start] == s->dev[start]) {       // Skip what the device already has
+            start++;
+        }
+        if (start == s->len) {
+            break;
+        }
+
+        end = start + 1;
+        for (uint32_t same = 0; end < s->len; end++) {                  // Extend until a long enough match
+            if (end < known && s->buf[end] == s->dev[end]) {
+                if (++same >= DELTA_RANGE_COST) {
+                    end -= same - 1;
+                    break;
+                }
+            } else {
+                same = 0;
+            }
+        }
+
+        f1c100s_spi_cmdbuf_write(ctx, start, &s->buf[start], end - start);
+        pos = end;
+    }
+
+    memcpy(s->dev, s->buf, s->len);
+    if (s->len > known) {
+        s->dev_len = s->len;
+    } else if (s->dev_len < s->len) {
+        s->dev_len = s->len;
+    }
+    s->dev_gen = f1c100s_spi_cmdbuf_gen(ctx);
+    return 1;
+}
+
+int spicmd_run(struct xfel_ctx_t *ctx, struct spicmd_t *s)
+{
+    if (!spicmd_upload(ctx, s)) {
+        return 0;
+    }
+    f1c100s_spi_exec(ctx);
+    return 1;
+}
+
+int spicmd_run_wait(struct xfel_ctx_t *ctx, struct spicmd_t *s, uint32_t timeout_ms)
+{
+    return spicmd_upload(ctx, s) && f1c100s_spi_exec_wait(ctx, timeout_ms);
+}
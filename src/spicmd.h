@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef SPICMD_H_
+#define SPICMD_H_
+
+#include <fel.h>
+
+/*
+ * Builder for SPI_CMD_* streams run by the SPI payload.
+ *
+ * Emitters append to the stream and return the offset of their variable part
+ * (a page address, a buffer address), usable as a loop field or for patching.
+ * spicmd_run() uploads only the ranges that differ from what the device got
+ * last time, so batches rebuilt with the same shape cost a few bytes.
+ */
+struct spicmd_t {
+    uint8_t *buf;
+    uint8_t *dev;               // Copy of what the device cmd buffer holds
+    uint32_t len;
+    uint32_t size;
+    uint32_t dev_len;           // Bytes of dev known to match the device
+    uint32_t dev_gen;           // f1c100s_spi_cmdbuf_gen() after our last upload
+    uint32_t loop_field;        // Next field of the open loop
+    int overflow;
+};
+
+int spicmd_init(struct spicmd_t *s, uint32_t size);
+void spicmd_free(struct spicmd_t *s);
+void spicmd_reset(struct spicmd_t *s);
+int spicmd_copy(struct spicmd_t *dst, const struct spicmd_t *src);
+
+void spicmd_select(struct spicmd_t *s);
+void spicmd_deselect(struct spicmd_t *s);
+uint32_t spicmd_fast(struct spicmd_t *s, const uint8_t *tx, uint8_t len);
+uint32_t spicmd_txbuf(struct spicmd_t *s, uint32_t addr, uint32_t len);
+uint32_t spicmd_rxbuf(struct spicmd_t *s, uint32_t addr, uint32_t len);
+void spicmd_spinand_wait(struct spicmd_t *s);
+uint32_t spicmd_loop(struct spicmd_t *s, uint32_t count, uint8_t nfields);
+void spicmd_loop_field(struct spicmd_t *s, uint32_t body, uint32_t at, uint8_t flags, uint32_t stride);
+void spicmd_next(struct spicmd_t *s);
+uint32_t spicmd_checkff(struct spicmd_t *s, uint32_t addr, uint32_t len, uint32_t result);
+void spicmd_end(struct spicmd_t *s);
+
+int spicmd_run(struct xfel_ctx_t *ctx, struct spicmd_t *s);
+int spicmd_run_wait(struct xfel_ctx_t *ctx, struct spicmd_t *s, uint32_t timeout_ms);
+
+#endif // SPICMD_H_
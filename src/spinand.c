@@ -4,22 +4,15 @@
  * Copyright 2007-2022 Jianjun Jiang <8192542@qq.com>
  */
 
-#include "spinand.h"
+#include <pthread.h>
 
+#include "spinand.h"
+#include "spicmd.h"
+#include "f1c100s_f1c200s_f1c500s.h"
+#include "trace.h"
+#include "stats.h"
+#include "report.h"
 
-struct spinand_info_t {
-    const char *name;
-    struct {
-        uint8_t val[4];
-        uint8_t len;
-    } id;
-    uint32_t page_size;
-    uint32_t spare_size;
-    uint32_t pages_per_block;
-    uint32_t blocks_per_die;
-    uint32_t planes_per_die;
-    uint32_t ndies;
-};
 
 struct spinand_pdata_t {
     struct spinand_info_t info;
@@ -28,6 +21,23 @@ struct spinand_pdata_t {
     uint32_t cmdlen;
 };
 
+/*
+ * The flash found and set up by the last full helper init of each xfel
+ * context: operations of one session skip RDID, reset and the feature
+ * registers, until the chip is reset or protection has to come off.
+ */
+struct spinand_session_t {
+    const struct xfel_ctx_t *ctx;
+    struct spinand_session_t *next;
+    struct spinand_info_t info;
+    uint32_t session;                           // f1c100s_session() it was set up in
+    int unlocked;
+    int valid;
+};
+
+static struct spinand_session_t *sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
 enum {
     OPCODE_RDID                 = 0x9f,
     OPCODE_GET_FEATURE          = 0x0f,
@@ -35,139 +45,152 @@ enum {
     OPCODE_FEATURE_PROTECT      = 0xa0,
     OPCODE_FEATURE_CONFIG       = 0xb0,
     OPCODE_FEATURE_STATUS       = 0xc0,
+    OPCODE_FEATURE_DIE_SELECT   = 0xd0,
     OPCODE_READ_PAGE_TO_CACHE   = 0x13,
     OPCODE_READ_PAGE_FROM_CACHE = 0x03,
     OPCODE_WRITE_ENABLE         = 0x06,
     OPCODE_BLOCK_ERASE          = 0xd8,
     OPCODE_PROGRAM_LOAD         = 0x02,
     OPCODE_PROGRAM_EXEC         = 0x10,
+    OPCODE_DIE_SELECT           = 0xc2,
     OPCODE_RESET                = 0xff,
 };
 
 #define SPINAND_ID(...)  { .val = { __VA_ARGS__ }, .len = sizeof ((uint8_t[]){ __VA_ARGS__ }) }
 static const struct spinand_info_t spinand_infos[] = {
     /* Winbond */
-    { "W25N512GV",       SPINAND_ID(0xef, 0xaa, 0x20), 2048,  64,  64,  512, 1, 1 },
-    { "W25N01GV",        SPINAND_ID(0xef, 0xaa, 0x21), 2048,  64,  64, 1024, 1, 1 },
-    { "W25M02GV",        SPINAND_ID(0xef, 0xab, 0x21), 2048,  64,  64, 1024, 1, 2 },
-    { "W25N02KV",        SPINAND_ID(0xef, 0xaa, 0x22), 2048, 128,  64, 2048, 1, 1 },
+    { "W25N512GV",       SPINAND_ID(0xef, 0xaa, 0x20), 2048,  64,  64,  512, 1, 1, 0 },
+    { "W25N01GV",        SPINAND_ID(0xef, 0xaa, 0x21), 2048,  64,  64, 1024, 1, 1, 0 },
+    { "W25M02GV",        SPINAND_ID(0xef, 0xab, 0x21), 2048,  64,  64, 1024, 1, 2, SPINAND_DIE_SELECT_CMD },
+    { "W25N02KV",        SPINAND_ID(0xef, 0xaa, 0x22), 2048, 128,  64, 2048, 1, 1, 0 },
 
     /* Gigadevice */
-    { "GD5F1GQ4UAWxx",   SPINAND_ID(0xc8, 0x10),       2048,  64,  64, 1024, 1, 1 },
-    { "GD5F1GQ5UExxG",   SPINAND_ID(0xc8, 0x51),       2048, 128,  64, 1024, 1, 1 },
-    { "GD5F1GQ4UExIG",   SPINAND_ID(0xc8, 0xd1),       2048, 128,  64, 1024, 1, 1 },
-    { "GD5F1GQ4UExxH",   SPINAND_ID(0xc8, 0xd9),       2048,  64,  64, 1024, 1, 1 },
-    { "GD5F1GQ4xAYIG",   SPINAND_ID(0xc8, 0xf1),       2048,  64,  64, 1024, 1, 1 },
-    { "GD5F2GQ4UExIG",   SPINAND_ID(0xc8, 0xd2),       2048, 128,  64, 2048, 1, 1 },
-    { "GD5F2GQ5UExxH",   SPINAND_ID(0xc8, 0x32),       2048,  64,  64, 2048, 1, 1 },
-    { "GD5F2GQ4xAYIG",   SPINAND_ID(0xc8, 0xf2),       2048,  64,  64, 2048, 1, 1 },
-    { "GD5F4GQ4UBxIG",   SPINAND_ID(0xc8, 0xd4),       4096, 256,  64, 2048, 1, 1 },
-    { "GD5F4GQ4xAYIG",   SPINAND_ID(0xc8, 0xf4),       2048,  64,  64, 4096, 1, 1 },
-    { "GD5F2GQ5UExxG",   SPINAND_ID(0xc8, 0x52),       2048, 128,  64, 2048, 1, 1 },
-    { "GD5F4GQ4UCxIG",   SPINAND_ID(0xc8, 0xb4),       4096, 256,  64, 2048, 1, 1 },
-    { "GD5F4GQ4RCxIG",   SPINAND_ID(0xc8, 0xa4),       4096, 256,  64, 2048, 1, 1 },
+    { "GD5F1GQ4UAWxx",   SPINAND_ID(0xc8, 0x10),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ5UExxG",   SPINAND_ID(0xc8, 0x51),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ4UExIG",   SPINAND_ID(0xc8, 0xd1),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ4UExxH",   SPINAND_ID(0xc8, 0xd9),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ4xAYIG",   SPINAND_ID(0xc8, 0xf1),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "GD5F2GQ4UExIG",   SPINAND_ID(0xc8, 0xd2),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "GD5F2GQ5UExxH",   SPINAND_ID(0xc8, 0x32),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "GD5F2GQ4xAYIG",   SPINAND_ID(0xc8, 0xf2),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4UBxIG",   SPINAND_ID(0xc8, 0xd4),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4xAYIG",   SPINAND_ID(0xc8, 0xf4),       2048,  64,  64, 4096, 1, 1, 0 },
+    { "GD5F2GQ5UExxG",   SPINAND_ID(0xc8, 0x52),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4UCxIG",   SPINAND_ID(0xc8, 0xb4),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4RCxIG",   SPINAND_ID(0xc8, 0xa4),       4096, 256,  64, 2048, 1, 1, 0 },
 
     /* Macronix */
-    { "MX35LF1GE4AB",    SPINAND_ID(0xc2, 0x12),       2048,  64,  64, 1024, 1, 1 },
-    { "MX35LF1G24AD",    SPINAND_ID(0xc2, 0x14),       2048, 128,  64, 1024, 1, 1 },
-    { "MX31LF1GE4BC",    SPINAND_ID(0xc2, 0x1e),       2048,  64,  64, 1024, 1, 1 },
-    { "MX35LF2GE4AB",    SPINAND_ID(0xc2, 0x22),       2048,  64,  64, 2048, 1, 1 },
-    { "MX35LF2G24AD",    SPINAND_ID(0xc2, 0x24),       2048, 128,  64, 2048, 1, 1 },
-    { "MX35LF2GE4AD",    SPINAND_ID(0xc2, 0x26),       2048, 128,  64, 2048, 1, 1 },
-    { "MX35LF2G14AC",    SPINAND_ID(0xc2, 0x20),       2048,  64,  64, 2048, 1, 1 },
-    { "MX35LF4G24AD",    SPINAND_ID(0xc2, 0x35),       4096, 256,  64, 2048, 1, 1 },
-    { "MX35LF4GE4AD",    SPINAND_ID(0xc2, 0x37),       4096, 256,  64, 2048, 1, 1 },
+    { "MX35LF1GE4AB",    SPINAND_ID(0xc2, 0x12),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "MX35LF1G24AD",    SPINAND_ID(0xc2, 0x14),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "MX31LF1GE4BC",    SPINAND_ID(0xc2, 0x1e),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "MX35LF2GE4AB",    SPINAND_ID(0xc2, 0x22),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "MX35LF2G24AD",    SPINAND_ID(0xc2, 0x24),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "MX35LF2GE4AD",    SPINAND_ID(0xc2, 0x26),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "MX35LF2G14AC",    SPINAND_ID(0xc2, 0x20),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "MX35LF4G24AD",    SPINAND_ID(0xc2, 0x35),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "MX35LF4GE4AD",    SPINAND_ID(0xc2, 0x37),       4096, 256,  64, 2048, 1, 1, 0 },
 
     /* Micron */
-    { "MT29F1G01AAADD",  SPINAND_ID(0x2c, 0x12),       2048,  64,  64, 1024, 1, 1 },
-    { "MT29F1G01ABAFD",  SPINAND_ID(0x2c, 0x14),       2048, 128,  64, 1024, 1, 1 },
-    { "MT29F2G01AAAED",  SPINAND_ID(0x2c, 0x9f),       2048,  64,  64, 2048, 2, 1 },
-    { "MT29F2G01ABAGD",  SPINAND_ID(0x2c, 0x24),       2048, 128,  64, 2048, 2, 1 },
-    { "MT29F4G01AAADD",  SPINAND_ID(0x2c, 0x32),       2048,  64,  64, 4096, 2, 1 },
-    { "MT29F4G01ABAFD",  SPINAND_ID(0x2c, 0x34),       4096, 256,  64, 2048, 1, 1 },
-    { "MT29F4G01ADAGD",  SPINAND_ID(0x2c, 0x36),       2048, 128,  64, 2048, 2, 2 },
-    { "MT29F8G01ADAFD",  SPINAND_ID(0x2c, 0x46),       4096, 256,  64, 2048, 1, 2 },
+    { "MT29F1G01AAADD",  SPINAND_ID(0x2c, 0x12),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "MT29F1G01ABAFD",  SPINAND_ID(0x2c, 0x14),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "MT29F2G01AAAED",  SPINAND_ID(0x2c, 0x9f),       2048,  64,  64, 2048, 2, 1, 0 },
+    { "MT29F2G01ABAGD",  SPINAND_ID(0x2c, 0x24),       2048, 128,  64, 2048, 2, 1, 0 },
+    { "MT29F4G01AAADD",  SPINAND_ID(0x2c, 0x32),       2048,  64,  64, 4096, 2, 1, 0 },
+    { "MT29F4G01ABAFD",  SPINAND_ID(0x2c, 0x34),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "MT29F4G01ADAGD",  SPINAND_ID(0x2c, 0x36),       2048, 128,  64, 2048, 2, 2, SPINAND_DIE_SELECT_FEATURE },
+    { "MT29F8G01ADAFD",  SPINAND_ID(0x2c, 0x46),       4096, 256,  64, 2048, 1, 2, SPINAND_DIE_SELECT_FEATURE },
 
     /* Toshiba */
-    { "TC58CVG0S3HRAIG", SPINAND_ID(0x98, 0xc2),       2048, 128,  64, 1024, 1, 1 },
-    { "TC58CVG1S3HRAIG", SPINAND_ID(0x98, 0xcb),       2048, 128,  64, 2048, 1, 1 },
-    { "TC58CVG2S0HRAIG", SPINAND_ID(0x98, 0xcd),       4096, 256,  64, 2048, 1, 1 },
-    { "TC58CVG0S3HRAIJ", SPINAND_ID(0x98, 0xe2),       2048, 128,  64, 1024, 1, 1 },
-    { "TC58CVG1S3HRAIJ", SPINAND_ID(0x98, 0xeb),       2048, 128,  64, 2048, 1, 1 },
-    { "TC58CVG2S0HRAIJ", SPINAND_ID(0x98, 0xed),       4096, 256,  64, 2048, 1, 1 },
-    { "TH58CVG3S0HRAIJ", SPINAND_ID(0x98, 0xe4),       4096, 256,  64, 4096, 1, 1 },
+    { "TC58CVG0S3HRAIG", SPINAND_ID(0x98, 0xc2),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "TC58CVG1S3HRAIG", SPINAND_ID(0x98, 0xcb),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "TC58CVG2S0HRAIG", SPINAND_ID(0x98, 0xcd),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "TC58CVG0S3HRAIJ", SPINAND_ID(0x98, 0xe2),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "TC58CVG1S3HRAIJ", SPINAND_ID(0x98, 0xeb),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "TC58CVG2S0HRAIJ", SPINAND_ID(0x98, 0xed),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "TH58CVG3S0HRAIJ", SPINAND_ID(0x98, 0xe4),       4096, 256,  64, 4096, 1, 1, 0 },
 
     /* Esmt */
-    { "F50L512M41A",     SPINAND_ID(0xc8, 0x20),       2048,  64,  64,  512, 1, 1 },
-    { "F50L1G41A",       SPINAND_ID(0xc8, 0x21),       2048,  64,  64, 1024, 1, 1 },
-    { "F50L1G41LB",      SPINAND_ID(0xc8, 0x01),       2048,  64,  64, 1024, 1, 1 },
-    { "F50L2G41LB",      SPINAND_ID(0xc8, 0x0a),       2048,  64,  64, 1024, 1, 2 },
+    { "F50L512M41A",     SPINAND_ID(0xc8, 0x20),       2048,  64,  64,  512, 1, 1, 0 },
+    { "F50L1G41A",       SPINAND_ID(0xc8, 0x21),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "F50L1G41LB",      SPINAND_ID(0xc8, 0x01),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "F50L2G41LB",      SPINAND_ID(0xc8, 0x0a),       2048,  64,  64, 1024, 1, 2, SPINAND_DIE_SELECT_CMD },
 
     /* Fison */
-    { "CS11G0T0A0AA",    SPINAND_ID(0x6b, 0x00),       2048, 128,  64, 1024, 1, 1 },
-    { "CS11G0G0A0AA",    SPINAND_ID(0x6b, 0x10),       2048, 128,  64, 1024, 1, 1 },
-    { "CS11G0S0A0AA",    SPINAND_ID(0x6b, 0x20),       2048,  64,  64, 1024, 1, 1 },
-    { "CS11G1T0A0AA",    SPINAND_ID(0x6b, 0x01),       2048, 128,  64, 2048, 1, 1 },
-    { "CS11G1S0A0AA",    SPINAND_ID(0x6b, 0x21),       2048,  64,  64, 2048, 1, 1 },
-    { "CS11G2T0A0AA",    SPINAND_ID(0x6b, 0x02),       2048, 128,  64, 4096, 1, 1 },
-    { "CS11G2S0A0AA",    SPINAND_ID(0x6b, 0x22),       2048,  64,  64, 4096, 1, 1 },
+    { "CS11G0T0A0AA",    SPINAND_ID(0x6b, 0x00),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "CS11G0G0A0AA",    SPINAND_ID(0x6b, 0x10),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "CS11G0S0A0AA",    SPINAND_ID(0x6b, 0x20),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "CS11G1T0A0AA",    SPINAND_ID(0x6b, 0x01),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "CS11G1S0A0AA",    SPINAND_ID(0x6b, 0x21),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "CS11G2T0A0AA",    SPINAND_ID(0x6b, 0x02),       2048, 128,  64, 4096, 1, 1, 0 },
+    { "CS11G2S0A0AA",    SPINAND_ID(0x6b, 0x22),       2048,  64,  64, 4096, 1, 1, 0 },
 
     /* Etron */
-    { "EM73B044VCA",     SPINAND_ID(0xd5, 0x01),       2048,  64,  64,  512, 1, 1 },
-    { "EM73C044SNB",     SPINAND_ID(0xd5, 0x11),       2048, 120,  64, 1024, 1, 1 },
-    { "EM73C044SNF",     SPINAND_ID(0xd5, 0x09),       2048, 128,  64, 1024, 1, 1 },
-    { "EM73C044VCA",     SPINAND_ID(0xd5, 0x18),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044SNA",     SPINAND_ID(0xd5, 0x19),       2048,  64, 128,  512, 1, 1 },
-    { "EM73C044VCD",     SPINAND_ID(0xd5, 0x1c),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1e),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73C044VCC",     SPINAND_ID(0xd5, 0x22),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044VCF",     SPINAND_ID(0xd5, 0x25),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044SNC",     SPINAND_ID(0xd5, 0x31),       2048, 128,  64, 1024, 1, 1 },
-    { "EM73D044SNC",     SPINAND_ID(0xd5, 0x0a),       2048, 120,  64, 2048, 1, 1 },
-    { "EM73D044SNA",     SPINAND_ID(0xd5, 0x12),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044SNF",     SPINAND_ID(0xd5, 0x10),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044VCA",     SPINAND_ID(0xd5, 0x13),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044VCB",     SPINAND_ID(0xd5, 0x14),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCD",     SPINAND_ID(0xd5, 0x17),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044VCH",     SPINAND_ID(0xd5, 0x1b),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCG",     SPINAND_ID(0xd5, 0x1f),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCE",     SPINAND_ID(0xd5, 0x20),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCL",     SPINAND_ID(0xd5, 0x2e),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044SNB",     SPINAND_ID(0xd5, 0x32),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73E044SNA",     SPINAND_ID(0xd5, 0x03),       4096, 256,  64, 2048, 1, 1 },
-    { "EM73E044SND",     SPINAND_ID(0xd5, 0x0b),       4096, 240,  64, 2048, 1, 1 },
-    { "EM73E044SNB",     SPINAND_ID(0xd5, 0x23),       4096, 256,  64, 2048, 1, 1 },
-    { "EM73E044VCA",     SPINAND_ID(0xd5, 0x2c),       4096, 256,  64, 2048, 1, 1 },
-    { "EM73E044VCB",     SPINAND_ID(0xd5, 0x2f),       2048, 128,  64, 4096, 1, 1 },
-    { "EM73F044SNA",     SPINAND_ID(0xd5, 0x24),       4096, 256,  64, 4096, 1, 1 },
-    { "EM73F044VCA",     SPINAND_ID(0xd5, 0x2d),       4096, 256,  64, 4096, 1, 1 },
-    { "EM73E044SNE",     SPINAND_ID(0xd5, 0x0e),       4096, 256,  64, 4096, 1, 1 },
-    { "EM73C044SNG",     SPINAND_ID(0xd5, 0x0c),       2048, 120,  64, 1024, 1, 1 },
-    { "EM73D044VCN",     SPINAND_ID(0xd5, 0x0f),       2048,  64,  64, 2048, 1, 1 },
+    { "EM73B044VCA",     SPINAND_ID(0xd5, 0x01),       2048,  64,  64,  512, 1, 1, 0 },
+    { "EM73C044SNB",     SPINAND_ID(0xd5, 0x11),       2048, 120,  64, 1024, 1, 1, 0 },
+    { "EM73C044SNF",     SPINAND_ID(0xd5, 0x09),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "EM73C044VCA",     SPINAND_ID(0xd5, 0x18),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044SNA",     SPINAND_ID(0xd5, 0x19),       2048,  64, 128,  512, 1, 1, 0 },
+    { "EM73C044VCD",     SPINAND_ID(0xd5, 0x1c),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1e),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73C044VCC",     SPINAND_ID(0xd5, 0x22),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044VCF",     SPINAND_ID(0xd5, 0x25),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044SNC",     SPINAND_ID(0xd5, 0x31),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "EM73D044SNC",     SPINAND_ID(0xd5, 0x0a),       2048, 120,  64, 2048, 1, 1, 0 },
+    { "EM73D044SNA",     SPINAND_ID(0xd5, 0x12),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044SNF",     SPINAND_ID(0xd5, 0x10),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCA",     SPINAND_ID(0xd5, 0x13),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCB",     SPINAND_ID(0xd5, 0x14),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCD",     SPINAND_ID(0xd5, 0x17),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCH",     SPINAND_ID(0xd5, 0x1b),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCG",     SPINAND_ID(0xd5, 0x1f),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCE",     SPINAND_ID(0xd5, 0x20),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCL",     SPINAND_ID(0xd5, 0x2e),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044SNB",     SPINAND_ID(0xd5, 0x32),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73E044SNA",     SPINAND_ID(0xd5, 0x03),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "EM73E044SND",     SPINAND_ID(0xd5, 0x0b),       4096, 240,  64, 2048, 1, 1, 0 },
+    { "EM73E044SNB",     SPINAND_ID(0xd5, 0x23),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "EM73E044VCA",     SPINAND_ID(0xd5, 0x2c),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "EM73E044VCB",     SPINAND_ID(0xd5, 0x2f),       2048, 128,  64, 4096, 1, 1, 0 },
+    { "EM73F044SNA",     SPINAND_ID(0xd5, 0x24),       4096, 256,  64, 4096, 1, 1, 0 },
+    { "EM73F044VCA",     SPINAND_ID(0xd5, 0x2d),       4096, 256,  64, 4096, 1, 1, 0 },
+    { "EM73E044SNE",     SPINAND_ID(0xd5, 0x0e),       4096, 256,  64, 4096, 1, 1, 0 },
+    { "EM73C044SNG",     SPINAND_ID(0xd5, 0x0c),       2048, 120,  64, 1024, 1, 1, 0 },
+    { "EM73D044VCN",     SPINAND_ID(0xd5, 0x0f),       2048,  64,  64, 2048, 1, 1, 0 },
 
     /* Elnec */
-    { "FM35Q1GA",        SPINAND_ID(0xe5, 0x71),       2048,  64,  64, 1024, 1, 1 },
+    { "FM35Q1GA",        SPINAND_ID(0xe5, 0x71),       2048,  64,  64, 1024, 1, 1, 0 },
 
     /* Paragon */
-    { "PN26G01A",        SPINAND_ID(0xa1, 0xe1),       2048, 128,  64, 1024, 1, 1 },
-    { "PN26G02A",        SPINAND_ID(0xa1, 0xe2),       2048, 128,  64, 2048, 1, 1 },
+    { "PN26G01A",        SPINAND_ID(0xa1, 0xe1),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "PN26G02A",        SPINAND_ID(0xa1, 0xe2),       2048, 128,  64, 2048, 1, 1, 0 },
 
     /* Ato */
-    { "ATO25D1GA",       SPINAND_ID(0x9b, 0x12),       2048,  64,  64, 1024, 1, 1 },
+    { "ATO25D1GA",       SPINAND_ID(0x9b, 0x12),       2048,  64,  64, 1024, 1, 1, 0 },
 
     /* Heyang */
-    { "HYF1GQ4U",        SPINAND_ID(0xc9, 0x51),       2048, 128,  64, 1024, 1, 1 },
-    { "HYF2GQ4U",        SPINAND_ID(0xc9, 0x52),       2048, 128,  64, 2048, 1, 1 },
-    { "HYF4GQ4U",        SPINAND_ID(0xc9, 0x54),       2048, 128,  64, 4096, 1, 1 },
+    { "HYF1GQ4U",        SPINAND_ID(0xc9, 0x51),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "HYF2GQ4U",        SPINAND_ID(0xc9, 0x52),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "HYF4GQ4U",        SPINAND_ID(0xc9, 0x54),       2048, 128,  64, 4096, 1, 1, 0 },
 
     /* FORESEE */
-    { "F35SQA001G",      SPINAND_ID(0xCD, 0x71, 0x71), 2048,  64,  64, 1024, 1, 1 },
-    { "F35SQA002G",      SPINAND_ID(0xCD, 0x72, 0x72), 2048,  64,  64, 2048, 1, 1 },
+    { "F35SQA001G",      SPINAND_ID(0xCD, 0x71, 0x71), 2048,  64,  64, 1024, 1, 1, 0 },
+    { "F35SQA002G",      SPINAND_ID(0xCD, 0x72, 0x72), 2048,  64,  64, 2048, 1, 1, 0 },
 };
 
 
+// Table entry of a supported chip by name, NULL if unknown
+const struct spinand_info_t * spinand_info_find(const char *name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(spinand_infos); i++) {
+        if (!strcmp(spinand_infos[i].name, name)) {
+            return &spinand_infos[i];
+        }
+    }
+    return NULL;
+}
+
 static int spinand_info(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat)
 {
     uint8_t tx[2] = { [0] = OPCODE_RDID, [1] = 0x0 };
@@ -203,14 +226,24 @@ static int spinand_info(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat)
     return 0;
 }
 
+// Reset and wait for OIP to clear, in one command stream
 static int spinand_reset(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat)
 {
-    uint8_t tx[1] = { OPCODE_RESET };
-    if (!fel_spi_xfer(ctx, pdat->swapbuf, pdat->swaplen, pdat->cmdlen, tx, sizeof (tx), 0, 0)) {
+    static const uint8_t tx[1] = { OPCODE_RESET };
+    struct spicmd_t s;
+    int ret;
+
+    if (pdat->cmdlen < 32 || !spicmd_init(&s, 32)) {
         return 0;
     }
-    usleep(100U * 1000);
-    return 1;
+    spicmd_select(&s);
+    spicmd_fast(&s, tx, sizeof (tx));
+    spicmd_deselect(&s);
+    spicmd_spinand_wait(&s);
+    spicmd_end(&s);
+    ret = spicmd_run(ctx, &s);
+    spicmd_free(&s);
+    return ret;
 }
 
 static int spinand_get_feature(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, uint8_t addr, uint8_t *val)
@@ -237,29 +270,146 @@ static int spinand_set_feature(struct xfel_ctx_t *ctx, struct spinand_pdata_t *p
 
 static int spinand_wait_for_busy(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat)
 {
-    uint8_t cbuf[256];
-    uint32_t clen = 0;
+    struct spicmd_t s;
+    int ret;
 
-    cbuf[clen++] = SPI_CMD_SELECT;
-    cbuf[clen++] = SPI_CMD_SPINAND_WAIT;
-    cbuf[clen++] = SPI_CMD_DESELECT;
-    cbuf[clen++] = SPI_CMD_END;
-    if (clen <= pdat->cmdlen) {
-        fel_chip_spi_run(ctx, cbuf, clen);
+    if (pdat->cmdlen < 16 || !spicmd_init(&s, 16)) {
+        return 0;
+    }
+    spicmd_spinand_wait(&s);
+    spicmd_end(&s);
+    ret = spicmd_run(ctx, &s);
+    spicmd_free(&s);
+    return ret;
+}
+
+/*
+ * Emit the die select sequence for die, returns whether one was needed.
+ * Single die chips need none.
+ */
+static int spinand_die_select(const struct spinand_pdata_t *pdat, struct spicmd_t *s, uint32_t die)
+{
+    if (pdat->info.flags & SPINAND_DIE_SELECT_CMD) {
+        uint8_t tx[2] = { OPCODE_DIE_SELECT, die };
+        spicmd_select(s);
+        spicmd_fast(s, tx, sizeof (tx));
+        spicmd_deselect(s);
+        return 1;
+    }
+    if (pdat->info.flags & SPINAND_DIE_SELECT_FEATURE) {
+        uint8_t tx[3] = { OPCODE_SET_FEATURE, OPCODE_FEATURE_DIE_SELECT, (die & 1) << 6 };
+        spicmd_select(s);
+        spicmd_fast(s, tx, sizeof (tx));
+        spicmd_deselect(s);
         return 1;
     }
     return 0;
 }
 
-static int spinand_helper_init(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, int unlock)
+static int spinand_select_die(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, uint32_t die)
 {
-    if (!(fel_spi_init(ctx, &pdat->swapbuf, &pdat->swaplen, &pdat->cmdlen) && spinand_info(ctx, pdat))) {
+    struct spicmd_t s;
+    int ret = 1;
+
+    if (!spicmd_init(&s, 16)) {
         return 0;
     }
+    if (spinand_die_select(pdat, &s, die)) {
+        spicmd_end(&s);
+        ret = spicmd_run(ctx, &s);
+    }
+    spicmd_free(&s);
+    return ret;
+}
 
-    spinand_reset(ctx, pdat);
-    spinand_wait_for_busy(ctx, pdat);
+/*
+ * NAND command pieces, the ones with an address return the offset of it so
+ * it can be stepped by a loop field.
+ */
+static void spinand_cmd_write_enable(struct spicmd_t *s)
+{
+    uint8_t tx[1] = { OPCODE_WRITE_ENABLE };                            // Write enable cmd
+    spicmd_select(s);
+    spicmd_fast(s, tx, sizeof (tx));
+    spicmd_deselect(s);
+}
+
+/*
+ * 24 bit row address of a READ_PAGE_TO_CACHE, PROGRAM_EXEC or BLOCK_ERASE,
+ * loop it as SPI_LOOP_BE(3). Chips with 16 bit rows take the top byte as
+ * dummy, and it stays 0 up to 65536 pages per die.
+ */
+static uint32_t spinand_cmd_page(struct spicmd_t *s, uint8_t opcode, uint32_t page)
+{
+    uint8_t tx[4] = {
+        [0] = opcode,
+        [1] = (page>>16) & 0xFF,                                        // Row address H (or dummy)
+        [2] = (page>>8)  & 0xFF,                                        // Row address M
+        [3] = (page>>0)  & 0xFF,                                        // Row address L
+    };
+    spicmd_select(s);
+    uint32_t at = spicmd_fast(s, tx, sizeof (tx)) + 1;
+    spicmd_deselect(s);
+    return at;
+}
 
+// Destination address of the RXBUF
+static uint32_t spinand_cmd_read_cache(struct spicmd_t *s, uint32_t dst_addr, uint32_t len)
+{
+    uint8_t tx[4] = { OPCODE_READ_PAGE_FROM_CACHE, 0, 0, 0 };          // Read data from buffer, column 0, dummy
+    spicmd_select(s);
+    spicmd_fast(s, tx, sizeof (tx));
+    uint32_t at = spicmd_rxbuf(s, dst_addr, len);                       // Receive data into RX Buffer
+    spicmd_deselect(s);
+    return at;
+}
+
+// Destination address of the Status-3 byte
+static uint32_t spinand_cmd_status(struct spicmd_t *s, uint32_t dst_addr)
+{
+    uint8_t tx[2] = { OPCODE_GET_FEATURE, OPCODE_FEATURE_STATUS };
+    spicmd_select(s);
+    spicmd_fast(s, tx, sizeof (tx));
+    uint32_t at = spicmd_rxbuf(s, dst_addr, 1);
+    spicmd_deselect(s);
+    return at;
+}
+
+/*
+ * Program one page on die from len bytes at src_addr, PROGRAM LOAD leaves
+ * the rest of the cache 0xFF. The cache is loaded only once the previous
+ * program on the die finished.
+ */
+static void spinand_cmd_program(const struct spinand_pdata_t *pdat, struct spicmd_t *s, uint32_t die, uint32_t page,
+                                uint32_t src_addr, uint32_t len, uint32_t *src_at, uint32_t *page_at)
+{
+    uint8_t tx[3] = { OPCODE_PROGRAM_LOAD, 0, 0 };                      // Program load cmd (Write to flash buffer), column 0
+
+    spinand_die_select(pdat, s, die);
+    spicmd_spinand_wait(s);                                             // Previous program on this die done
+    spinand_cmd_write_enable(s);
+    spicmd_select(s);
+    spicmd_fast(s, tx, sizeof (tx));
+    uint32_t at = spicmd_txbuf(s, src_addr, len);                       // Transfer contents from TX Buffer
+    spicmd_deselect(s);
+    uint32_t pat = spinand_cmd_page(s, OPCODE_PROGRAM_EXEC, page);      // Execute program (Write page)
+
+    if (src_at) {
+        *src_at = at;
+    }
+    if (page_at) {
+        *page_at = pat;
+    }
+}
+
+// Pages in the whole chip, all dies included
+static uint32_t spinand_pages(const struct spinand_pdata_t *pdat)
+{
+    return pdat->info.pages_per_block * pdat->info.blocks_per_die * pdat->info.ndies;
+}
+
+static int spinand_die_setup(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, int unlock)
+{
     uint8_t val;
 
     if (unlock) {
@@ -321,8 +471,96 @@ static int spinand_helper_init(struct xfel_ctx_t *ctx, struct spinand_pdata_t *p
     return 1;
 }
 
+static struct spinand_session_t * spinand_session(const struct xfel_ctx_t *ctx)
+{
+    struct spinand_session_t *ss;
+
+    pthread_mutex_lock(&sessions_lock);
+    for (ss = sessions; ss && ss->ctx != ctx; ss = ss->next) {
+    }
+    if (!ss && (ss = calloc(1, sizeof (*ss)))) {
+        ss->ctx = ctx;
+        ss->next = sessions;
+        sessions = ss;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    return ss;                                  // NULL: no memory, set up every time
+}
+
+static void spinand_session_forget(const struct xfel_ctx_t *ctx)
+{
+    struct spinand_session_t *ss = spinand_session(ctx);
+
+    if (ss) {
+        ss->valid = 0;
+    }
+}
+
+void spinand_release(const struct xfel_ctx_t *ctx)
+{
+    pthread_mutex_lock(&sessions_lock);
+    for (struct spinand_session_t **p = &sessions; *p; p = &(*p)->next) {
+        if ((*p)->ctx == ctx) {
+            struct spinand_session_t *ss = *p;
+            *p = ss->next;
+            free(ss);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+static int spinand_helper_init(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, int unlock)
+{
+    struct spinand_session_t *ss;
+    uint64_t t = stats_begin();
+    int ok = fel_spi_init(ctx, &pdat->swapbuf, &pdat->swaplen, &pdat->cmdlen);
+
+    stats_end(STATS_INIT, t, 0);
+    if (!ok) {
+        return 0;
+    }
+    t = stats_begin();
+    ss = spinand_session(ctx);
+    if (ss && ss->valid && ss->session == f1c100s_session(ctx) && (ss->unlocked || !unlock)) {
+        pdat->info = ss->info;
+        if (pdat->info.ndies > 1 && !spinand_select_die(ctx, pdat, 0)) {      // The last operation may have ended on another die
+            return 0;
+        }
+        stats_end(STATS_DETECT, t, 0);
+        return 1;
+    }
+    if (ss) {
+        ss->valid = 0;
+    }
+    if (!spinand_info(ctx, pdat)) {
+        return 0;
+    }
+
+    if (!spinand_reset(ctx, pdat)) {
+        return 0;
+    }
+
+    for (uint32_t die = pdat->info.ndies; die-- > 0; ) {               // Protection and ECC are per die, end on die 0
+        spinand_select_die(ctx, pdat, die);
+        if (!spinand_die_setup(ctx, pdat, unlock)) {
+            return 0;
+        }
+    }
+    if (ss) {
+        ss->info = pdat->info;
+        ss->session = f1c100s_session(ctx);
+        ss->unlocked = unlock;
+        ss->valid = 1;
+    }
+    stats_end(STATS_DETECT, t, 0);
+
+    return 1;
+}
+
 
-int spinand_detect(struct xfel_ctx_t *ctx, char *name, size_t *capacity)
+int spinand_detect(struct xfel_ctx_t *ctx, char *name, uint64_t *capacity)
 {
     struct spinand_pdata_t pdat;
     if (!spinand_helper_init(ctx, &pdat, 0)) {
@@ -333,245 +571,861 @@ int spinand_detect(struct xfel_ctx_t *ctx, char *name, size_t *capacity)
         strcpy(name, pdat.info.name);
     }
     if (capacity) {
-        *capacity = (size_t)pdat.info.page_size * pdat.info.pages_per_block * pdat.info.blocks_per_die * pdat.info.ndies;
+        *capacity = (uint64_t)pdat.info.page_size * pdat.info.pages_per_block * pdat.info.blocks_per_die * pdat.info.ndies;
     }
     return 1;
 }
 
-int dso2d_erase(struct xfel_ctx_t *ctx)
+static int spinand_read_pages(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, uint32_t page, uint32_t count, void *buf)
+{
+    uint32_t page_size = pdat->info.page_size;
+    struct spicmd_t s;
+
+    if (count == 0 || count*page_size > pdat->swaplen || !spicmd_init(&s, 128)) {
+        return 0;
+    }
+
+    uint32_t body = spicmd_loop(&s, count, 2);
+    uint32_t at = spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, page);   // Load page into buffer
+    spicmd_loop_field(&s, body, at, SPI_LOOP_BE(3), 1);
+    spicmd_spinand_wait(&s);                                            // Check Busy flag
+    at = spinand_cmd_read_cache(&s, pdat->swapbuf, page_size);
+    spicmd_loop_field(&s, body, at, SPI_LOOP_LE(4), page_size);
+    spicmd_next(&s);
+    spicmd_end(&s);
+
+    int ret = spicmd_run(ctx, &s);
+    spicmd_free(&s);
+    if (ret) {
+        fel_read(ctx, pdat->swapbuf, buf, count*page_size);
+    }
+    return ret;
+}
+
+/*
+ * Re-initialise the SPI controller at the currently selected clock and read
+ * back the ID and a few pages, comparing them against a reference.
+ */
+static int spinand_clock_check(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat,
+                               uint32_t count, const uint8_t *ref, uint8_t *buf)
+{
+    enum { CAL_ROUNDS = 3U };
+
+    uint8_t tx[2] = { OPCODE_RDID, 0x0 };
+    uint8_t rx[4];
+
+    if (!fel_spi_init(ctx, &pdat->swapbuf, &pdat->swaplen, &pdat->cmdlen)) {
+        return 0;
+    }
+
+    for (uint32_t r = 0; r < CAL_ROUNDS; r++) {
+        if (!fel_spi_xfer(ctx, pdat->swapbuf, pdat->swaplen, pdat->cmdlen, tx, 2, rx, 4)) {
+            return 0;
+        }
+        if (memcmp(rx, pdat->info.id.val, pdat->info.id.len) != 0) {
+            tx[0] = OPCODE_RDID;                                        // Some chips don't take the dummy byte
+            if (!fel_spi_xfer(ctx, pdat->swapbuf, pdat->swaplen, pdat->cmdlen, tx, 1, rx, 4)
+                || memcmp(rx, pdat->info.id.val, pdat->info.id.len) != 0) {
+                return 0;
+            }
+        }
+        if (!spinand_read_pages(ctx, pdat, 0, count, buf)
+            || memcmp(buf, ref, (size_t)count*pdat->info.page_size) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int spinand_calibrate_clock(struct xfel_ctx_t *ctx, uint32_t *hz)
+{
+    enum { CAL_PAGES = 4U };
+
+    static const uint32_t steps[] = {                                   // Slowest first, the first one is the reference
+        12500000, 25000000, 33400000, 50000000, 100000000,
+    };
+
+    struct spinand_pdata_t pdat;
+    uint8_t *ref = NULL, *buf = NULL;
+    size_t i, best = 0;
+    int ret = 0;
+
+    f1c100s_spi_clock_set(ctx, steps[0]);
+    if (!spinand_helper_init(ctx, &pdat, 0)) {
+        return 0;
+    }
+
+    ref = malloc((size_t)CAL_PAGES*pdat.info.page_size);
+    buf = malloc((size_t)CAL_PAGES*pdat.info.page_size);
+    if (!ref || !buf || !spinand_read_pages(ctx, &pdat, 0, CAL_PAGES, ref)) {
+        goto CLEANUP;
+    }
+
+    printf("Calibrating SPI clock...\n");
+    trace_phase("calibrate");
+    for (i = 0; i < ARRAY_SIZE(steps); i++) {
+        uint32_t f = f1c100s_spi_clock_set(ctx, steps[i]);
+        int ok = spinand_clock_check(ctx, &pdat, CAL_PAGES, ref, buf);
+        printf("  %6.2f MHz: %s\n", f / 1e6, ok ? "OK" : "FAIL");
+        if (!ok) {
+            break;
+        }
+        best = i;
+    }
+
+    if (i == 0) {
+        printf("Flash not readable even at the slowest SPI clock!\n");
+        f1c100s_spi_clock_set(ctx, steps[0]);
+        goto CLEANUP;
+    }
+    if (i < ARRAY_SIZE(steps)) {                                        // Garbled commands may have reached the flash
+        spinand_session_forget(ctx);
+    }
+    if (best > 0) {                                                     // One step of margin below the fastest passing clock
+        best--;
+    }
+
+    *hz = f1c100s_spi_clock_set(ctx, steps[best]);
+    ret = fel_spi_init(ctx, &pdat.swapbuf, &pdat.swaplen, &pdat.cmdlen);
+
+CLEANUP:
+    free(ref);
+    free(buf);
+    return ret;
+}
+
+/*
+ * Read every page, spare area included, and let the payload check it for
+ * 0xFF: blank[die*blocks + block] ends up 0xFF for blocks with nothing
+ * programmed. Only that map comes back over USB.
+ */
+static int spinand_blank_check(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts,
+                               const struct spinand_pdata_t *pdat, uint8_t *blank)
+{
+    enum {
+        BLANK_CMD_SZ   = 144U,                  // Per block and die: first load, loop field and body, last read, worst case with die select
+        BLANK_BLOCKS   = 16U,
+        BLANK_PAGE_US  = 100U,                  // tRD max and command overhead on top of the transfer
+        BLANK_SLACK_MS = 2000U,
+    };
+
+    struct report_t p;
+    struct spicmd_t s;
+    uint32_t ndies = pdat->info.ndies;
+    uint32_t ppb = pdat->info.pages_per_block;
+    uint32_t blocks = pdat->info.blocks_per_die;
+    uint32_t raw = (pdat->info.page_size + pdat->info.spare_size) & ~3U;
+    uint32_t map = pdat->swapbuf + ndies*raw;
+    uint32_t page_us = BLANK_PAGE_US + (uint32_t)((raw*8ULL*1000000) / f1c100s_spi_clock_get(ctx));
+    int ret = 1;
+
+    if (!spicmd_init(&s, (BLANK_CMD_SZ*ndies*BLANK_BLOCKS)+8)) {
+        return 0;
+    }
+
+    memset(blank, 0xFF, ndies*blocks);
+    fel_write(ctx, map, blank, ndies*blocks);
+
+    printf("\nBlank checking flash...\n");
+    report_start(&p, "blank-check", (uint64_t)spinand_pages(pdat)*pdat->info.page_size, opts->progress, opts->user);
+    for (uint32_t block = 0; ret && block < blocks; ) {
+        uint32_t count = (blocks - block) < BLANK_BLOCKS ? (blocks - block) : BLANK_BLOCKS;
+        uint64_t t = stats_begin();
+
+        spicmd_reset(&s);
+        for (uint32_t b = block; b < block + count; b++) {          // Pages of a block as in dso2d_dump(), checked in place
+            for (uint32_t die = 0; die < ndies; die++) {
+                spinand_die_select(pdat, &s, die);
+                spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, b*ppb);
+            }
+            uint32_t body = spicmd_loop(&s, ppb - 1, ndies);
+            for (uint32_t die = 0; die < ndies; die++) {
+                spinand_die_select(pdat, &s, die);
+                spicmd_spinand_wait(&s);
+                spinand_cmd_read_cache(&s, pdat->swapbuf + die*raw, raw);
+                spicmd_checkff(&s, pdat->swapbuf + die*raw, raw, map + die*blocks + b);
+                uint32_t at = spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, b*ppb + 1);
+                spicmd_loop_field(&s, body, at, SPI_LOOP_BE(3), 1);
+            }
+            spicmd_next(&s);
+            for (uint32_t die = 0; die < ndies; die++) {
+                spinand_die_select(pdat, &s, die);
+                spicmd_spinand_wait(&s);
+                spinand_cmd_read_cache(&s, pdat->swapbuf + die*raw, raw);
+                spicmd_checkff(&s, pdat->swapbuf + die*raw, raw, map + die*blocks + b);
+            }
+        }
+        spicmd_end(&s);
+        stats_end(STATS_BUILD, t, 0);
+
+        ret = spicmd_run_wait(ctx, &s, (count*ndies*ppb*page_us)/1000 + BLANK_SLACK_MS);
+        block += count;
+        report_update(&p, (uint64_t)count*ndies*ppb*pdat->info.page_size);
+    }
+    report_stop(&p);
+    if (ret) {
+        fel_read(ctx, map, blank, ndies*blocks);
+    }
+    spicmd_free(&s);
+    return ret;
+}
+
+/*
+ * The whole erase list stays on the device as one loop over the blocks, so
+ * each exec only uploads its new start block and count. By default a single
+ * exec erases the whole chip and the time is down to tBERS, the status wait
+ * is sized for the worst case instead of the USB timeout of xfel.
+ *
+ * With the blank check, blocks found blank are left out; runs of blocks to
+ * erase on every die still become one loop.
+ */
+int dso2d_erase(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts)
 {
-    enum { ERASE_CMD_SZ  = 64U };
+    enum {
+        ERASE_CMD_SZ   = 48U,                   // Per die and block: erase and wait, worst case with die select
+        ERASE_BLOCK_MS = 10U,                   // tBERS max of the supported chips
+        ERASE_SLACK_MS = 2000U,
+    };
 
-    struct progress_t p;
+    struct report_t p;
     struct spinand_pdata_t pdat;
-    uint8_t cbuf[(ERASE_CMD_SZ*16)+1];
-
-    for (size_t i = 0; i < ERASE_CMD_SZ; ++i) { // Make a large cmd queue to reduce overhead
-        uint8_t *d = &cbuf[16*i];
-        d[0]  = SPI_CMD_SELECT;                 // Write enable
-        d[1]  = SPI_CMD_FAST;
-        d[2]  = 1;
-        d[3]  = OPCODE_WRITE_ENABLE;
-        d[4]  = SPI_CMD_DESELECT;
-        d[5]  = SPI_CMD_SELECT;
-        d[6]  = SPI_CMD_FAST;
-        d[7]  = 4;
-        d[8]  = OPCODE_BLOCK_ERASE;             // Erase block
-        d[9]  = 0;                              // Dummy
-        d[10] = 0;                              // Block address
-        d[11] = 0;
-        d[12] = SPI_CMD_DESELECT;
-        d[13] = SPI_CMD_SELECT;                 // Check busy
-        d[14] = SPI_CMD_SPINAND_WAIT;
-        d[15] = SPI_CMD_DESELECT;
-    }
-    cbuf[16*ERASE_CMD_SZ] = SPI_CMD_END;        // Done
-
-    if (!spinand_helper_init(ctx, &pdat, 1) || sizeof (cbuf) > pdat.cmdlen ) {
+    struct spicmd_t s;
+    uint8_t *blank = NULL;
+
+    if (!spinand_helper_init(ctx, &pdat, 1)) {
         return 0;
     }
 
-    uint32_t pages, page = 0, n = pdat.info.page_size;
+    uint32_t ndies = pdat.info.ndies;
+    uint32_t ppb = pdat.info.pages_per_block;
+    uint32_t blocks = pdat.info.blocks_per_die;
+    uint32_t chunk = (opts->erase_chunk && opts->erase_chunk < blocks) ? opts->erase_chunk : blocks;
+    uint32_t n = pdat.info.page_size;
+    uint32_t block = 0;
+    uint32_t skipped = 0;
+    int ret = 1;
+
+    if (!spicmd_init(&s, (ERASE_CMD_SZ*ndies*(opts->blank_check ? chunk : 1))+8)) {
+        return 0;
+    }
+    if (opts->blank_check) {
+        blank = malloc(ndies*blocks);
+        if (!blank || !spinand_blank_check(ctx, opts, &pdat, blank)) {
+            free(blank);
+            spicmd_free(&s);
+            return 0;
+        }
+    }
 
     printf("\nErasing flash...\n");
-    pages = pdat.info.pages_per_block * pdat.info.blocks_per_die * pdat.info.ndies * pdat.info.planes_per_die;
-    progress_start(&p, pages*n);
-    while (page < pages) {
-        for (size_t i = 0; i < ERASE_CMD_SZ; i++) { // Make a large cmd queue to reduce overhead
-            uint8_t *d = &cbuf[16*i];
-            d[10] = (page>>8) & 0xFF;                              // Block address
-            d[11] = (page>>0) & 0xFF;
-            page += pdat.info.pages_per_block;
-        }
-        fel_chip_spi_run(ctx, cbuf, sizeof (cbuf));              // Run Command buffer
-        progress_update(&p, ERASE_CMD_SZ*n*pdat.info.pages_per_block);
-    }
-    progress_stop(&p);
-    return 1;
+    report_start(&p, "erase", (uint64_t)spinand_pages(&pdat)*n, opts->progress, opts->user);
+    while (ret && block < blocks) {                 // Same block on every die, so one erases while the others are busy
+        uint32_t count = (blocks - block) < chunk ? (blocks - block) : chunk;
+        uint64_t t = stats_begin();
+
+        spicmd_reset(&s);
+        for (uint32_t b = block; b < block + count; ) {
+            uint32_t run = 0;
+
+            for (; b+run < block + count; run++) {     // Blocks to erase on every die
+                uint32_t die = 0;
+                for (; die < ndies && !(blank && blank[die*blocks + b+run] == 0xFF); die++) {
+                }
+                if (die < ndies) {
+                    break;
+                }
+            }
+
+            if (run > 0) {
+                uint32_t body = spicmd_loop(&s, run, ndies);
+                for (uint32_t die = 0; die < ndies; die++) {    // One pass per block, the loop steps the block address
+                    spinand_die_select(&pdat, &s, die);
+                    spicmd_spinand_wait(&s);        // Wait for previous erase on this die
+                    spinand_cmd_write_enable(&s);
+                    uint32_t at = spinand_cmd_page(&s, OPCODE_BLOCK_ERASE, b*ppb);
+                    spicmd_loop_field(&s, body, at, SPI_LOOP_BE(3), ppb);
+                }
+                spicmd_next(&s);
+                b += run;
+                continue;
+            }
+
+            for (uint32_t die = 0; die < ndies; die++) {
+                if (blank[die*blocks + b] == 0xFF) {      // Nothing programmed, skip
+                    skipped++;
+                    continue;
+                }
+                spinand_die_select(&pdat, &s, die);
+                spicmd_spinand_wait(&s);
+                spinand_cmd_write_enable(&s);
+                spinand_cmd_page(&s, OPCODE_BLOCK_ERASE, b*ppb);
+            }
+            b++;
+        }
+        for (uint32_t die = 0; die < ndies; die++) {
+            spinand_die_select(&pdat, &s, die);
+            spicmd_spinand_wait(&s);                // Check busy
+        }
+        spicmd_end(&s);                             // Done
+        stats_end(STATS_BUILD, t, 0);
+
+        ret = spicmd_run_wait(ctx, &s, count*ERASE_BLOCK_MS + ERASE_SLACK_MS);    // Run Command buffer
+        block += count;
+        report_update(&p, (uint64_t)count*ndies*ppb*n);
+    }
+    report_stop(&p);
+    if (blank) {
+        printf("%u of %u blocks were blank already\n", skipped, ndies*blocks);
+    }
+    free(blank);
+    spicmd_free(&s);
+    return ret;
 }
 
-int dso2d_dump(struct xfel_ctx_t *ctx, void *buf)
+/*
+ * Fetch the pages of one die from a dump batch into rx, leaving the ones
+ * blank[r*stride] marks as 0xFF on the device. Short runs of blank pages
+ * are read anyway, a fel_read() of its own would cost more. tail bytes
+ * right behind the pages come along, with the last run if it reaches them.
+ */
+static void dump_fetch(struct xfel_ctx_t *ctx, uint32_t src, uint8_t *rx, const uint8_t *blank, uint32_t stride,
+                       uint32_t count, uint32_t page_size, uint32_t tail)
 {
     enum {
-        RX_CMD_SZ     = 28U,
-        RX_BLOCK_SIZE = 128U,
+        SPARSE_GAP_BYTES = 24U*1024,                // About the fixed cost of one more fel_read(), 9 USB transfers
+    };
+    uint32_t max_gap = SPARSE_GAP_BYTES / page_size;
+
+    memset(rx, 0xFF, count*page_size);
+    for (uint32_t r = 0; r < count; ) {
+        uint32_t end, gap = 0;
+
+        if (blank[r*stride] == 0xFF) {
+            r++;
+            continue;
+        }
+        for (end = r + 1; end < count && gap <= max_gap; end++) {
+            gap = (blank[end*stride] == 0xFF) ? gap + 1 : 0;
+        }
+        end -= gap;
+        if (end == count) {
+            fel_read(ctx, src + r*page_size, rx + r*page_size, (end - r)*page_size + tail);
+            return;
+        }
+        fel_read(ctx, src + r*page_size, rx + r*page_size, (end - r)*page_size);
+        r = end;
+    }
+    if (tail) {
+        fel_read(ctx, src + count*page_size, rx + count*page_size, tail);
+    }
+}
+
+int dso2d_dump(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, spinand_sink_t sink, void *user)
+{
+    enum {
+        RX_CMD_SZ     = 240U,                       // Per die: first load, loop fields and body, last read, worst case with die select and checks
+        RX_BLOCK_SIZE = 504U,                       // Not 512: the status bytes fit in the last 64 KiB fel_read() chunk
     };
 
     struct spinand_pdata_t pdat;
+    struct spicmd_t s;
 
     if (!spinand_helper_init(ctx, &pdat, 0)) {
         return 0;
     }
 
-    struct progress_t progress;
-    uint32_t page = 0, pages = pdat.info.pages_per_block*pdat.info.blocks_per_die*pdat.info.ndies*pdat.info.planes_per_die;
+    struct report_t progress;
+    uint32_t ndies = pdat.info.ndies;
+    uint32_t pages = spinand_pages(&pdat);
+    uint32_t die_pages = pages / ndies;
+    uint32_t rows = RX_BLOCK_SIZE / ndies;          // Pages per die in one batch
     uint32_t page_size = pdat.info.page_size;
-    uint32_t read_size = RX_BLOCK_SIZE * page_size;
-    uint8_t cbuf[(RX_CMD_SZ*RX_BLOCK_SIZE) + 1];
-
-    for (size_t i = 0; i < RX_BLOCK_SIZE; i++) { // Make a large cmd queue to reduce overhead
-        uint8_t *d = &cbuf[RX_CMD_SZ*i];
-
-        d[0] = SPI_CMD_SELECT;
-        d[1] = SPI_CMD_FAST;
-        d[2] = 4;
-        d[3] = OPCODE_READ_PAGE_TO_CACHE;                               // Load page into buffer
-        d[4] = 0;                                                       // Dummy
-                                                                        // 5-6 Page address to read, updated later
-        d[7] = SPI_CMD_DESELECT;
-        d[8] = SPI_CMD_SELECT;
-        d[9] = SPI_CMD_SPINAND_WAIT;                                    // Check Busy flag
-        d[10] = SPI_CMD_DESELECT;
-        d[11] = SPI_CMD_SELECT;
-        d[12] = SPI_CMD_FAST;
-        d[13] = 4;
-        d[14] = OPCODE_READ_PAGE_FROM_CACHE;                            // Read data from buffer
-        d[15] = 0;                                                      // Column address H
-        d[16] = 0;                                                      // Column address L
-        d[17] = 0;                                                      // Dummy
-        d[18] = SPI_CMD_RXBUF;                                          // Receive data into RX Buffer
-                                                                        // 19-22 Dest address,  updated later
-        d[23] = (page_size>>0)  & 0xFF;                                 // Rx length = page size + spare size
-        d[24] = (page_size>>8)  & 0xFF;
-        d[25] = (page_size>>16) & 0xFF;
-        d[26] = (page_size>>24) & 0xFF;
-        d[27] = SPI_CMD_DESELECT;
-    }
-
-    cbuf[RX_CMD_SZ*RX_BLOCK_SIZE] = SPI_CMD_END;
-
-    if (sizeof (cbuf) > pdat.cmdlen ) {
-        printf("cbuf: is too large for cmdbuf! %zu : %u\n", sizeof (cbuf), pdat.cmdlen);
+    uint32_t flags = pdat.swapbuf + RX_BLOCK_SIZE*(page_size + 1);      // Sparse: 0xFF for blank pages, [row*ndies + die]
+    uint32_t nfields = opts->sparse_read ? 5 : 3;
+    int ret = 1;
+
+    uint8_t *rx, *blank;
+
+    if (RX_BLOCK_SIZE*(page_size + 1) + (opts->sparse_read ? pages : 0) > pdat.swaplen) {
         return 0;
     }
+    rx = malloc(rows*page_size + RX_BLOCK_SIZE);
+    blank = malloc(opts->sparse_read ? pages : 1);
+    if (!rx || !blank || !spicmd_init(&s, (RX_CMD_SZ*ndies)+8)) {
+        free(rx);
+        free(blank);
+        return 0;
+    }
+    if (opts->sparse_read) {                        // Checks only clear bits, so they all start out set
+        memset(blank, 0xFF, pages);
+        fel_write(ctx, flags, blank, pages);
+    }
 
     printf("Reading flash...\n");
-    progress_start(&progress, pages*page_size);
-
-    while (page < pages) {
-        for (size_t i = 0; i < RX_BLOCK_SIZE; ++i) {
-            uint8_t *d = &cbuf[RX_CMD_SZ*i];
-            uint32_t p = page+i;
-            uint32_t dst_addr = pdat.swapbuf+(i*page_size);
-
-            d[5] = (p>>8)  & 0xFF;                                      // Page address to read H
-            d[6] = (p>>0)  & 0xFF;                                      // Page address to read L
-            d[19] = (dst_addr>>0)  & 0xFF;                              // Dest address
-            d[20] = (dst_addr>>8)  & 0xFF;
-            d[21] = (dst_addr>>16) & 0xFF;
-            d[22] = (dst_addr>>24) & 0xFF;
-        }
-        fel_chip_spi_run(ctx, cbuf, sizeof (cbuf));                      // Run Command buffer
-        fel_read(ctx, pdat.swapbuf, buf, read_size);                    // Receive RX buffer
-        buf += read_size;
-        page += RX_BLOCK_SIZE;
-        progress_update(&progress, read_size);
-    }
-    progress_stop(&progress);
-    return 1;
+    report_start(&progress, "read", (uint64_t)die_pages*ndies*page_size, opts->progress, opts->user);
+
+    /*
+     * Each die gets its next page loaded right after its cache was read out,
+     * so with several dies tRD of one overlaps the transfer of the others.
+     * Only the first load and the last read out are outside of the loop.
+     *
+     * Status-3 of every page goes right behind the data of the last die,
+     * [die*count + r], so it comes back with that read and costs no extra
+     * transfer.
+     *
+     * With sparse_read the payload also checks every page for 0xFF, and
+     * only the pages with data are fetched after the flags of the batch.
+     */
+    for (uint32_t row = 0; ret && row < die_pages; row += rows) {
+        uint32_t count = (die_pages - row) < rows ? (die_pages - row) : rows;
+        uint32_t ecc = pdat.swapbuf + ndies*count*page_size;
+        uint64_t t = stats_begin();
+
+        spicmd_reset(&s);
+        for (uint32_t die = 0; die < ndies; die++) {
+            spinand_die_select(&pdat, &s, die);
+            spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, row);       // Load page into buffer
+        }
+        if (count > 1) {
+            uint32_t body = spicmd_loop(&s, count - 1, nfields*ndies);
+            for (uint32_t die = 0; die < ndies; die++) {
+                uint32_t dst = pdat.swapbuf + (die*count*page_size);
+                spinand_die_select(&pdat, &s, die);
+                spicmd_spinand_wait(&s);                                // Check Busy flag
+                uint32_t at = spinand_cmd_status(&s, ecc + die*count);  // ECC outcome of the load
+                spicmd_loop_field(&s, body, at, SPI_LOOP_LE(4), 1);
+                at = spinand_cmd_read_cache(&s, dst, page_size);
+                spicmd_loop_field(&s, body, at, SPI_LOOP_LE(4), page_size);
+                if (opts->sparse_read) {
+                    at = spicmd_checkff(&s, dst, page_size, flags + row*ndies + die);
+                    spicmd_loop_field(&s, body, at - 8, SPI_LOOP_LE(4), page_size);
+                    spicmd_loop_field(&s, body, at, SPI_LOOP_LE(4), ndies);
+                }
+                at = spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, row + 1);
+                spicmd_loop_field(&s, body, at, SPI_LOOP_BE(3), 1);
+            }
+            spicmd_next(&s);
+        }
+        for (uint32_t die = 0; die < ndies; die++) {
+            uint32_t dst = pdat.swapbuf + ((die*count + count - 1) * page_size);
+            spinand_die_select(&pdat, &s, die);
+            spicmd_spinand_wait(&s);
+            spinand_cmd_status(&s, ecc + die*count + count - 1);
+            spinand_cmd_read_cache(&s, dst, page_size);
+            if (opts->sparse_read) {
+                spicmd_checkff(&s, dst, page_size, flags + (row + count - 1)*ndies + die);
+            }
+        }
+        spicmd_end(&s);
+        stats_end(STATS_BUILD, t, 0);
+
+        ret = spicmd_run(ctx, &s);                                      // Run Command buffer
+        if (ret && opts->sparse_read) {
+            fel_read(ctx, flags + row*ndies, blank, count*ndies);
+        }
+        for (uint32_t die = 0; ret && die < ndies; die++) {             // Receive RX buffer, the last die with the status bytes
+            uint32_t src = pdat.swapbuf + (die*count*page_size);
+            uint32_t tail = (die == ndies - 1) ? ndies*count : 0;
+            if (!opts->sparse_read) {
+                fel_read(ctx, src, rx, count*page_size + tail);
+            } else {
+                dump_fetch(ctx, src, rx, blank + die, ndies, count, page_size, opts->ecc ? tail : 0);
+            }
+            ret = sink(user, ((uint64_t)die*die_pages + row) * page_size, rx, count*page_size);
+        }
+        for (uint32_t die = 0; ret && opts->ecc && die < ndies; die++) {
+            memcpy(opts->ecc + die*die_pages + row, rx + count*page_size + die*count, count);
+        }
+        report_update(&progress, (uint64_t)count*ndies*page_size);
+    }
+    report_stop(&progress);
+    spicmd_free(&s);
+    free(blank);
+    free(rx);
+    return ret;
 }
 
-int dso2d_restore(struct xfel_ctx_t *ctx, void *buf)
+/*
+ * Load every page into the cache and keep only Status-3 the chip reports
+ * for it: status[die*die_pages + row] gets the register with its ECC bits,
+ * collected in SDRAM by the payload. Page data never leaves the chip, one
+ * byte per page comes back over USB.
+ */
+int dso2d_health(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, uint8_t *status, uint32_t len)
 {
-    int ret = 1;
-
     enum {
-        TX_CMD_SZ     = 32U,
-        TX_BLOCK_SIZE = 128U,
+        HEALTH_CMD_SZ   = 96U,                      // Per die: first load, loop fields and body, last status, worst case with die select
+        HEALTH_ROWS     = 4096U,
+        HEALTH_PAGE_US  = 100U,                     // tRD max and command overhead
+        HEALTH_SLACK_MS = 2000U,
     };
 
-    if (!dso2d_erase(ctx)) {
+    struct spinand_pdata_t pdat;
+    struct spicmd_t s;
+
+    if (!spinand_helper_init(ctx, &pdat, 0)) {
+        return 0;
+    }
+
+    struct report_t progress;
+    uint32_t ndies = pdat.info.ndies;
+    uint32_t pages = spinand_pages(&pdat);
+    uint32_t die_pages = pages / ndies;
+    uint32_t map = pdat.swapbuf;
+    int ret = 1;
+
+    if (len < pages || pages > pdat.swaplen || !spicmd_init(&s, (HEALTH_CMD_SZ*ndies)+8)) {
         return 0;
     }
 
+    printf("Checking flash health...\n");
+    report_start(&progress, "health", (uint64_t)pages*pdat.info.page_size, opts->progress, opts->user);
+
+    /*
+     * Same order as dso2d_dump(): the status of a die is fetched once its
+     * load is done, right before the next load on it, so with several dies
+     * tRD of one overlaps the others.
+     */
+    for (uint32_t row = 0; ret && row < die_pages; row += HEALTH_ROWS) {
+        uint32_t count = (die_pages - row) < HEALTH_ROWS ? (die_pages - row) : HEALTH_ROWS;
+        uint64_t t = stats_begin();
+
+        spicmd_reset(&s);
+        for (uint32_t die = 0; die < ndies; die++) {
+            spinand_die_select(&pdat, &s, die);
+            spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, row);
+        }
+        if (count > 1) {
+            uint32_t body = spicmd_loop(&s, count - 1, 2*ndies);
+            for (uint32_t die = 0; die < ndies; die++) {
+                spinand_die_select(&pdat, &s, die);
+                spicmd_spinand_wait(&s);
+                uint32_t at = spinand_cmd_status(&s, map + die*die_pages + row);
+                spicmd_loop_field(&s, body, at, SPI_LOOP_LE(4), 1);
+                at = spinand_cmd_page(&s, OPCODE_READ_PAGE_TO_CACHE, row + 1);
+                spicmd_loop_field(&s, body, at, SPI_LOOP_BE(3), 1);
+            }
+            spicmd_next(&s);
+        }
+        for (uint32_t die = 0; die < ndies; die++) {
+            spinand_die_select(&pdat, &s, die);
+            spicmd_spinand_wait(&s);
+            spinand_cmd_status(&s, map + die*die_pages + row + count - 1);
+        }
+        spicmd_end(&s);
+        stats_end(STATS_BUILD, t, 0);
+
+        ret = spicmd_run_wait(ctx, &s, (count*ndies*HEALTH_PAGE_US)/1000 + HEALTH_SLACK_MS);
+        report_update(&progress, (uint64_t)count*ndies*pdat.info.page_size);
+    }
+    report_stop(&progress);
+    if (ret) {
+        fel_read(ctx, map, status, pages);
+    }
+    spicmd_free(&s);
+    return ret;
+}
+
+// Bytes of the page up to its last one not 0xFF, in words; 0 for an empty page
+static uint32_t page_used(const uint8_t *d, uint32_t len)
+{
+    while (len > 0 && d[len-1] == 0xFF) {
+        len--;
+    }
+    return (len + 3) & ~3U;
+}
+
+enum {
+    TX_CMD_SZ     = 64U,                                                    // Per page: loop field share and program, worst case with die select
+    TX_BLOCK_SIZE = 512U,
+    TX_QUEUE      = 3U,                                                     // Batches prepared ahead of the USB side
+    TX_DIRECT     = 32U,                                                    // Shortest run of pages uploaded straight from the image
+    TX_ROWS       = 4U*TX_BLOCK_SIZE,                                       // Pages looked at per batch, empty ones included
+};
+
+// A contiguous range of page data for the swap buffer
+struct restore_upload_t {
+    const uint8_t *src;
+    uint32_t addr;
+    uint32_t len;
+};
+
+struct restore_batch_t {
+    struct spicmd_t cmd;
+    struct restore_upload_t *up;
+    uint32_t nup;
+    uint8_t *gather;                                                        // Pages of short runs, sent as one upload
+    uint32_t pages;                                                         // Pages to program
+    uint32_t rows;                                                          // Rows covered, empty pages included
+};
+
+struct restore_queue_t {
+    const struct spinand_pdata_t *pdat;
+    const uint8_t *buf;
+    struct restore_batch_t batch[TX_QUEUE];
+    uint32_t produced;
+    uint32_t consumed;
+    int done;                                                               // Producer has no more batches
+    int stop;                                                               // Consumer gave up
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * Build the batch starting at row, taking rows until TX_BLOCK_SIZE pages
+ * need programming. Runs of at least TX_DIRECT pages go to the swap buffer
+ * straight from the image, one upload each. Pages of shorter runs are
+ * gathered into a staging area behind them instead, as every upload costs a
+ * few USB round trips, and only up to their last byte not 0xFF. The commands
+ * address every page where it was put, so empty pages are neither sent nor
+ * programmed, and load no more of a page than that either.
+ *
+ * Pages are visited row by row across the dies: a die is only waited on
+ * right before its next program, so the other dies program meanwhile.
+ * Rows whose pages step along evenly on every die become one loop, the
+ * rest is unrolled with empty pages skipped.
+ */
+static uint32_t restore_build(const struct restore_queue_t *q, struct restore_batch_t *b, uint32_t first)
+{
+    const struct spinand_pdata_t *pdat = q->pdat;
+    struct spicmd_t *s = &b->cmd;
+    uint32_t ndies = pdat->info.ndies;
+    uint32_t die_pages = spinand_pages(pdat) / ndies;
+    uint32_t page_size = pdat->info.page_size;
+    uint32_t max_rows = TX_ROWS / ndies;
+    uint32_t direct = pdat->swapbuf;
+    uint32_t staging = pdat->swapbuf + (TX_BLOCK_SIZE * page_size);
+    uint32_t addr[TX_ROWS];                                                 // [die*rows + r], 0 for empty pages
+    uint32_t used[TX_ROWS];                                                 // [die*max_rows + r], see page_used()
+    uint32_t gathered = 0;
+    uint32_t rows = 0;
+
+    b->nup = 0;
+    b->pages = 0;
+    for (; first+rows < die_pages && rows < max_rows; rows++) {
+        uint32_t n = 0;
+        for (uint32_t die = 0; die < ndies; die++) {
+            used[die*max_rows + rows] = page_used(q->buf + (((size_t)die*die_pages + first+rows) * page_size), page_size);
+            n += (used[die*max_rows + rows] != 0);
+        }
+        if (b->pages + n > TX_BLOCK_SIZE) {
+            break;
+        }
+        b->pages += n;
+    }
+
+    for (uint32_t die = 0; die < ndies; die++) {
+        const uint8_t *src = q->buf + (((size_t)die*die_pages + first) * page_size);
+        uint32_t *at = &addr[die*rows];
+
+        for (uint32_t r = 0; r < rows; ) {
+            uint32_t run = 0;
+            for (; r+run < rows && used[die*max_rows + r+run]; run++) {
+            }
+            if (run == 0) {                                                 // Empty page (All FF), skip
+                at[r++] = 0;
+                continue;
+            }
+
+            if (run >= TX_DIRECT) {
+                b->up[b->nup++] = (struct restore_upload_t){ src + r*page_size, direct, run*page_size };
+                for (uint32_t i = 0; i < run; i++) {
+                    at[r+i] = direct + i*page_size;
+                }
+                direct += run*page_size;
+            } else {
+                for (uint32_t i = 0; i < run; i++) {
+                    memcpy(b->gather + gathered, src + (r+i)*page_size, used[die*max_rows + r+i]);
+                    at[r+i] = staging + gathered;
+                    gathered += used[die*max_rows + r+i];
+                }
+            }
+            r += run;
+        }
+    }
+    if (gathered > 0) {
+        b->up[b->nup++] = (struct restore_upload_t){ b->gather, staging, gathered };
+    }
+
+    spicmd_reset(s);
+    for (uint32_t r = 0; r < rows; ) {
+        uint32_t run = 0;
+
+        for (; r+run < rows; run++) {
+            uint32_t die = 0;
+            for (; die < ndies; die++) {
+                uint32_t a = addr[die*rows + r], at = addr[die*rows + r+run];
+                if (a == 0 || at != a + run*page_size
+                    || (at >= staging && used[die*max_rows + r+run] != page_size)) {    // Gathered pages are packed, a
+                    break;                                                          // longer load takes in the next
+                }
+            }
+            if (die < ndies) {
+                break;
+            }
+        }
+
+        if (run > 1) {
+            uint32_t body = spicmd_loop(s, run, 2*ndies);
+            for (uint32_t die = 0; die < ndies; die++) {
+                uint32_t src_at, page_at, len = 0;
+                for (uint32_t i = 0; i < run; i++) {                        // One load length for the loop, the longest
+                    len = (used[die*max_rows + r+i] > len) ? used[die*max_rows + r+i] : len;
+                }
+                spinand_cmd_program(pdat, s, die, first+r, addr[die*rows + r], len, &src_at, &page_at);
+                spicmd_loop_field(s, body, src_at, SPI_LOOP_LE(4), page_size);
+                spicmd_loop_field(s, body, page_at, SPI_LOOP_BE(3), 1);
+            }
+            spicmd_next(s);
+            r += run;
+            continue;
+        }
+
+        for (uint32_t die = 0; die < ndies; die++) {
+            if (addr[die*rows + r] != 0) {
+                spinand_cmd_program(pdat, s, die, first+r, addr[die*rows + r], used[die*max_rows + r], NULL, NULL);
+            }
+        }
+        r++;
+    }
+
+    for (uint32_t die = 0; die < ndies; die++) {
+        spinand_die_select(pdat, s, die);
+        spicmd_spinand_wait(s);                                             // Check busy
+    }
+    spicmd_end(s);                                                          // Finish cmd
+
+    b->rows = rows;
+    return first + rows;
+}
+
+// Fills free queue slots with batches while the USB side sends the others
+static void *restore_producer(void *arg)
+{
+    struct restore_queue_t *q = arg;
+    uint32_t die_pages = spinand_pages(q->pdat) / q->pdat->info.ndies;
+    uint32_t row = 0;
+
+    while (row < die_pages) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->stop && q->produced - q->consumed == TX_QUEUE) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        int stop = q->stop;
+        pthread_mutex_unlock(&q->lock);
+        if (stop) {
+            break;
+        }
+
+        uint64_t t = stats_begin();
+        row = restore_build(q, &q->batch[q->produced % TX_QUEUE], row);
+        stats_end(STATS_BUILD, t, 0);
+
+        pthread_mutex_lock(&q->lock);
+        q->produced++;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+int dso2d_restore(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, const void *buf)
+{
+    return dso2d_erase(ctx, opts) && dso2d_program(ctx, opts, buf);
+}
+
+int dso2d_program(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, const void *buf)
+{
     struct spinand_pdata_t pdat;
+    int ret = 1;
+
     if (!spinand_helper_init(ctx, &pdat, 1)) {
         return 0;
     }
 
-    struct progress_t progress;
-    uint32_t page = 0, pages = pdat.info.pages_per_block*pdat.info.blocks_per_die*pdat.info.ndies*pdat.info.planes_per_die;
+    struct report_t progress;
+    struct restore_queue_t q = { .pdat = &pdat, .buf = buf };
+    struct spicmd_t s;                                                      // Sends every batch, so delta uploads carry over
+    uint32_t pages = spinand_pages(&pdat);
     uint32_t page_size = pdat.info.page_size;
-    uint32_t pages_to_write = 0;
-    uint8_t cbuf[(TX_CMD_SZ*TX_BLOCK_SIZE) + 1];                           // Make a large cmd queue to reduce overhead
-    uint8_t *dbuf = malloc(TX_BLOCK_SIZE*page_size);
+    uint32_t slots = 0;
+    pthread_t producer;
+
+    if (2*TX_BLOCK_SIZE*page_size > pdat.swaplen || !spicmd_init(&s, (TX_CMD_SZ*TX_BLOCK_SIZE)+1)) {
+        return 0;
+    }
+    for (; slots < TX_QUEUE; slots++) {
+        q.batch[slots].up = malloc((TX_BLOCK_SIZE/TX_DIRECT + 1) * sizeof (struct restore_upload_t));
+        q.batch[slots].gather = malloc(TX_BLOCK_SIZE * page_size);
+        if (!q.batch[slots].up || !q.batch[slots].gather || !spicmd_init(&q.batch[slots].cmd, (TX_CMD_SZ*TX_BLOCK_SIZE)+1)) {
+            free(q.batch[slots].up);
+            free(q.batch[slots].gather);
+            ret = 0;
+            goto CLEANUP;
+        }
+    }
 
-    if ((sizeof cbuf) > pdat.cmdlen) {
-        printf("cbuf is too large for cmdbuf! %zu : %u\n", sizeof (cbuf), pdat.cmdlen);
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    if (pthread_create(&producer, NULL, restore_producer, &q) != 0) {
+        printf("Unable to start the batch producer thread!\n");
         ret = 0;
-        goto CLEANUP;
+        goto DESTROY;
     }
 
     printf("\nWriting flash...\n");
-    progress_start(&progress, pages*page_size);
-    uint32_t last_page = 0, i;
-    uint8_t *d = buf;
-    while (page < pages) {
-        i = 0;
-        pages_to_write = 0;
-
-        for (uint32_t j = 0; (j < page_size) && (page < pages); ) {                // Scan data for empty pages (All FF), fill data buffer
-            if (d[j] != 0xFF) {                                              // If not FF data found, store page
-                memcpy(&dbuf[i*page_size], d, page_size);                   // Copy page data
-                uint8_t *c = &cbuf[i*TX_CMD_SZ];
-
-                c[0]  = SPI_CMD_SELECT;                                     // Fill cmd data
-                c[1]  = SPI_CMD_FAST;
-                c[2]  = 1;
-                c[3]  = OPCODE_WRITE_ENABLE;                                // Write enable cmd
-                c[4]  = SPI_CMD_DESELECT;
-                c[5]  = SPI_CMD_SELECT;
-                c[6]  = SPI_CMD_FAST;
-                c[7]  = 3;
-                c[8]  = OPCODE_PROGRAM_LOAD;                                // Program load cmd (Write to flash buffer)
-                c[9]  = 0;                                                  // Column address H
-                c[10] = 0;                                                  // Column address L
-                c[11] = SPI_CMD_TXBUF;                                      // Transfer contents from TX Buffer
-                c[12] = ((pdat.swapbuf+(i*page_size))>>0)  & 0xFF;          // Src address = SDRAM
-                c[13] = ((pdat.swapbuf+(i*page_size))>>8)  & 0xFF;
-                c[14] = ((pdat.swapbuf+(i*page_size))>>16) & 0xFF;
-                c[15] = ((pdat.swapbuf+(i*page_size))>>24) & 0xFF;
-                c[16] = (page_size>>0)  & 0xFF;                             // Tx length = page size + spare size
-                c[17] = (page_size>>8)  & 0xFF;
-                c[18] = (page_size>>16) & 0xFF;
-                c[19] = (page_size>>24) & 0xFF;
-                c[20] = SPI_CMD_DESELECT;
-                c[21] = SPI_CMD_SELECT;
-                c[22] = SPI_CMD_FAST;
-                c[23] = 4;
-                c[24] = OPCODE_PROGRAM_EXEC;                                // Execute program (Write page)
-                c[25] = 0;                                                  // Dummy
-                c[26] = (page>>8) & 0xFF;                                   // Page address to write H
-                c[27] = (page>>0) & 0xFF;                                   // Page address to write L                                                                      // 26-27 Page address to write, updated later
-                c[28] = SPI_CMD_DESELECT;
-                c[29] = SPI_CMD_SELECT;
-                c[30] = SPI_CMD_SPINAND_WAIT;                               // Check busy
-                c[31] = SPI_CMD_DESELECT;
-
-                pages_to_write++;                                           // Increase pages to be written
-                page++;                                                     // Increase current page
-                d += page_size;                                             // Increase input buffer
-                j = 0;
-                if (++i >= TX_BLOCK_SIZE) {
-                    break;
-                }                                                           // Done with this page
-            } else if (++j == page_size) {                                  // Increase scan, if reached end of page, it's empty, skip
-                page++;                                                     // Increase page
-                d += page_size;                                             // Increase input buffer
-                j = 0;                                                        // Reset counter
+    report_start(&progress, "write", (uint64_t)pages*page_size, opts->progress, opts->user);
+
+    for (;;) {
+        pthread_mutex_lock(&q.lock);
+        while (q.consumed == q.produced && !q.done) {
+            pthread_cond_wait(&q.cond, &q.lock);
+        }
+        int empty = (q.consumed == q.produced);
+        pthread_mutex_unlock(&q.lock);
+        if (empty) {
+            break;
+        }
+
+        struct restore_batch_t *b = &q.batch[q.consumed % TX_QUEUE];
+        if (b->pages > 0) {
+            for (uint32_t i = 0; i < b->nup; i++) {                         // Transfer page data
+                fel_write(ctx, b->up[i].addr, (void *)b->up[i].src, b->up[i].len);
             }
+            spicmd_copy(&s, &b->cmd);
+            ret = spicmd_run(ctx, &s);                                      // Run Command buffer
+        }
+        report_update(&progress, (uint64_t)b->rows*pdat.info.ndies*page_size);  // Update progress
+
+        pthread_mutex_lock(&q.lock);
+        q.consumed++;
+        q.stop = !ret;
+        pthread_cond_broadcast(&q.cond);
+        pthread_mutex_unlock(&q.lock);
+        if (!ret) {
+            break;
         }
-        cbuf[pages_to_write*TX_CMD_SZ] = SPI_CMD_END;                       // Finish cmd
-        fel_write(ctx, pdat.swapbuf, dbuf, pages_to_write * page_size);     // Transfer TX buffer
-        fel_chip_spi_run(ctx, cbuf, (TX_CMD_SZ*pages_to_write)+1);          // Run Command buffer
-        progress_update(&progress, (page-last_page)*page_size);                    // Update progress
-        last_page = page;
     }
 
-    progress_stop(&progress);
+    pthread_join(producer, NULL);
+    report_stop(&progress);
+
+DESTROY:
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
 
 CLEANUP:
-    free(dbuf);
+    while (slots-- > 0) {
+        spicmd_free(&q.batch[slots].cmd);
+        free(q.batch[slots].up);
+        free(q.batch[slots].gather);
+    }
+    spicmd_free(&s);
 
     return ret;
 }
@@ -9,11 +9,60 @@
 
 #include <fel.h>
 
-int spinand_detect(struct xfel_ctx_t *ctx, char *name, size_t *capacity);
+struct spinand_info_t {
+    const char *name;
+    struct {
+        uint8_t val[4];
+        uint8_t len;
+    } id;
+    uint32_t page_size;
+    uint32_t spare_size;
+    uint32_t pages_per_block;
+    uint32_t blocks_per_die;
+    uint32_t planes_per_die;
+    uint32_t ndies;
+    uint32_t flags;
+};
 
-int dso2d_dump(struct xfel_ctx_t *ctx, void *buf);
-int dso2d_restore(struct xfel_ctx_t *ctx, void *buf);
-int dso2d_erase(struct xfel_ctx_t *ctx);
+enum {
+    SPINAND_DIE_SELECT_CMD      = 1U << 0,  // Software die select, opcode 0xc2
+    SPINAND_DIE_SELECT_FEATURE  = 1U << 1,  // Die select bit in feature register 0xd0
+};
+
+const struct spinand_info_t * spinand_info_find(const char *name);
+
+struct spinand_opts_t {
+    uint32_t erase_chunk;       // Blocks per die erased by one exec, 0 for all
+    int blank_check;            // Skip blocks with nothing programmed when erasing
+    uint8_t *ecc;               // Status-3 of every page a dump reads, die major, NULL to drop it
+    int sparse_read;            // Dumps leave pages of 0xFF on the device, checked there
+    void (*progress)(void *user, const char *phase, uint64_t done, uint64_t total);   // NULL for the terminal bar
+    void *user;
+};
+
+// ECC outcome of a page in Status-3 (ECCS1:0), as collected by dso2d_health()
+#define SPINAND_ECCS(status)    (((status) >> 4) & 3U)
+enum {
+    SPINAND_ECC_OK              = 0,        // No bit flips
+    SPINAND_ECC_CORRECTED       = 1,        // Bit flips corrected
+    SPINAND_ECC_FAILED          = 2,        // Uncorrectable
+    SPINAND_ECC_CORRECTED_MAX   = 3,        // Corrected at the limit of the ECC (GigaDevice), vendor specific elsewhere
+};
+
+// Gets the flash contents of a dump in pieces, in no particular order; returns 0 to abort
+typedef int (*spinand_sink_t)(void *user, uint64_t offset, const void *buf, uint32_t len);
+
+// Flash setup is kept per xfel context, see f1c100s_session(), until released
+void spinand_release(const struct xfel_ctx_t *ctx);
+int spinand_detect(struct xfel_ctx_t *ctx, char *name, uint64_t *capacity);
+int spinand_calibrate_clock(struct xfel_ctx_t *ctx, uint32_t *hz);
+
+int dso2d_dump(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, spinand_sink_t sink, void *user);
+int dso2d_restore(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, const void *buf);
+// dso2d_restore() without the erase, for a flash dso2d_erase() left empty
+int dso2d_program(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, const void *buf);
+int dso2d_erase(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts);
+int dso2d_health(struct xfel_ctx_t *ctx, const struct spinand_opts_t *opts, uint8_t *status, uint32_t len);
 int dso2d_dump_regs(struct xfel_ctx_t *ctx);
 
 #endif // SPINAND_H_
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <pthread.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define STATS_HIST_BUCKETS  (32U)                       // Bucket i: intervals under 2^i us
+#define STATS_PHASES_MAX    (16U)
+
+struct stats_timer_t {
+    uint64_t count;
+    uint64_t ns;
+    uint64_t bytes;
+    uint64_t hist[STATS_HIST_BUCKETS];
+};
+
+struct stats_phase_t {
+    char name[32];
+    uint64_t begin, end;
+    uint64_t out, in;
+};
+
+static const char *const timer_names[STATS_TIMERS] = {
+    [STATS_INIT]    = "init",
+    [STATS_DETECT]  = "detect",
+    [STATS_BUILD]   = "build",
+    [STATS_USB_OUT] = "usb_out",
+    [STATS_EXEC]    = "exec",
+    [STATS_USB_IN]  = "usb_in",
+    [STATS_HASH]    = "hash",
+    [STATS_FILE]    = "file",
+};
+
+static struct {
+    int enabled;
+    pthread_mutex_t lock;                       // Batches are built while the previous ones transfer
+    uint64_t t0;
+    struct stats_timer_t timers[STATS_TIMERS];
+    struct stats_phase_t phases[STATS_PHASES_MAX];
+    uint32_t nphases;
+} st = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+void stats_enable(void)
+{
+    st.enabled = 1;
+    st.t0 = trace_clock_ns();
+}
+
+int stats_enabled(void)
+{
+    return st.enabled;
+}
+
+uint64_t stats_begin(void)
+{
+    return st.enabled ? trace_clock_ns() : 0;
+}
+
+void stats_end(enum stats_timer t, uint64_t begin, uint64_t bytes)
+{
+    if (st.enabled) {
+        stats_add(t, trace_clock_ns() - begin, bytes);
+    }
+}
+
+void stats_add(enum stats_timer t, uint64_t ns, uint64_t bytes)
+{
+    struct stats_timer_t *tm = &st.timers[t];
+    uint32_t b = 0;
+
+    if (!st.enabled) {
+        return;
+    }
+    for (uint64_t us = ns / 1000; us && b < STATS_HIST_BUCKETS - 1; us >>= 1) {
+        b++;
+    }
+
+    pthread_mutex_lock(&st.lock);
+    tm->count++;
+    tm->ns += ns;
+    tm->bytes += bytes;
+    tm->hist[b]++;
+    if (st.nphases) {
+        struct stats_phase_t *ph = &st.phases[st.nphases - 1];
+        if (t == STATS_USB_OUT) {
+            ph->out += bytes;
+        } else if (t == STATS_USB_IN) {
+            ph->in += bytes;
+        }
+    }
+    pthread_mutex_unlock(&st.lock);
+}
+
+void stats_phase(const char *name)
+{
+    uint64_t now = trace_clock_ns();
+
+    if (!st.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&st.lock);
+    if (st.nphases) {
+        st.phases[st.nphases - 1].end = now;
+    }
+    if (st.nphases < STATS_PHASES_MAX) {
+        struct stats_phase_t *ph = &st.phases[st.nphases++];
+        snprintf(ph->name, sizeof (ph->name), "%s", name);
+        ph->begin = now;
+        ph->end = 0;
+    }
+    pthread_mutex_unlock(&st.lock);
+}
+
+static double mb_s(uint64_t bytes, uint64_t ns)
+{
+    return ns ? (bytes * 1e3) / ns : 0;
+}
+
+void stats_report_json(FILE *f)
+{
+    uint64_t now = trace_clock_ns();
+
+    pthread_mutex_lock(&st.lock);
+    fprintf(f, "{\"elapsed_s\":%.6f,\"phases\":[", (now - st.t0) / 1e9);
+    for (uint32_t i = 0; i < st.nphases; i++) {
+        const struct stats_phase_t *ph = &st.phases[i];
+        uint64_t ns = (ph->end ? ph->end : now) - ph->begin;
+        fprintf(f, "%s{\"name\":\"%s\",\"s\":%.6f,\"usb_out_bytes\":%llu,\"usb_in_bytes\":%llu,\"mb_s\":%.3f}",
+                i ? "," : "", ph->name, ns / 1e9, (unsigned long long)ph->out, (unsigned long long)ph->in,
+                mb_s(ph->out + ph->in, ns));
+    }
+    fprintf(f, "],\"timers\":{");
+    for (uint32_t t = 0; t < STATS_TIMERS; t++) {
+        const struct stats_timer_t *tm = &st.timers[t];
+        int first = 1;
+        fprintf(f, "%s\"%s\":{\"count\":%llu,\"s\":%.6f,\"bytes\":%llu,\"mb_s\":%.3f,\"hist_us\":[",
+                t ? "," : "", timer_names[t], (unsigned long long)tm->count, tm->ns / 1e9,
+                (unsigned long long)tm->bytes, mb_s(tm->bytes, tm->ns));
+        for (uint32_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+            if (tm->hist[b]) {
+                fprintf(f, "%s{\"lt\":%llu,\"count\":%llu}", first ? "" : ",",
+                        1ULL << b, (unsigned long long)tm->hist[b]);
+                first = 0;
+            }
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "}}\n");
+    pthread_mutex_unlock(&st.lock);
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Timers around the parts of a run, for telling a USB bound station from a
+ * SPI or disk bound one. USB out/in and exec come from the FEL calls the
+ * trace decodes, the others are taken where the work is done. Every timer
+ * keeps a log2 histogram of its intervals (one per batch for exec), phases
+ * (see trace_phase()) their wall time and USB bytes.
+ *
+ * All of it costs nothing until stats_enable().
+ */
+enum stats_timer {
+    STATS_INIT,                 // DDR and SPI payload init
+    STATS_DETECT,               // Flash ID, reset, die setup
+    STATS_BUILD,                // Command streams and page batches
+    STATS_USB_OUT,              // fel_write
+    STATS_EXEC,                 // fel_exec, until the payload returned
+    STATS_USB_IN,               // fel_read
+    STATS_HASH,
+    STATS_FILE,
+    STATS_TIMERS
+};
+
+void stats_enable(void);
+int stats_enabled(void);
+
+uint64_t stats_begin(void);
+void stats_end(enum stats_timer t, uint64_t begin, uint64_t bytes);
+void stats_add(enum stats_timer t, uint64_t ns, uint64_t bytes);
+void stats_phase(const char *name);
+
+void stats_report_json(FILE *f);
+
+#endif // STATS_H_
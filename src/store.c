@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <fel.h>
+
+#include "store.h"
+#include "stats.h"
+#include "md5.h"
+
+#define STORE_MAGIC         "dsoflash-manifest 1"
+
+
+static void md5_hex(struct UL_MD5Context *ctx, char *hex)
+{
+    unsigned char d[UL_MD5LENGTH];
+
+    ul_MD5Final(d, ctx);
+    for (int i = 0; i < UL_MD5LENGTH; i++) {
+        sprintf(hex + 2*i, "%02x", d[i]);
+    }
+}
+
+static int dir_make(const char *path)
+{
+    if (mkdir(path, 0777) && errno != EEXIST) {
+        printf("Unable to create directory %s!\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Digests name files, so nothing but 32 lowercase hex digits is one
+static int digest_valid(const char *s)
+{
+    return strlen(s) == 32 && strspn(s, "0123456789abcdef") == 32;
+}
+
+static void chunk_path(char *path, size_t len, const char *dir, const char *digest)
+{
+    snprintf(path, len, "%s/%.2s/%s", dir, digest, digest);
+}
+
+// 1 if the chunk was stored, 2 if the store had it already, 0 on failure
+static int chunk_put(const char *dir, const char *digest, const void *buf, uint32_t len)
+{
+    uint64_t t = stats_begin();
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    struct stat st;
+    FILE *f;
+    int r;
+
+    chunk_path(path, sizeof (path), dir, digest);
+    if (!stat(path, &st) && (uint64_t)st.st_size == len) {
+        return 2;
+    }
+    snprintf(tmp, sizeof (tmp), "%s/%.2s", dir, digest);
+    if (!dir_make(tmp)) {
+        return 0;
+    }
+    snprintf(tmp, sizeof (tmp), "%s.%ld", path, (long)getpid());
+    if (!(f = fopen(tmp, "wb"))) {
+        printf("Unable to write file %s!\n", tmp);
+        return 0;
+    }
+    r = fwrite(buf, len, 1, f);
+    if (fclose(f) || !r || rename(tmp, path)) {
+        printf("Unable to write file %s!\n", path);
+        remove(tmp);
+        return 0;
+    }
+    stats_end(STATS_FILE, t, len);
+    return 1;
+}
+
+static int chunk_get(const char *dir, const char *digest, void *buf, uint32_t len)
+{
+    uint64_t t = stats_begin();
+    struct UL_MD5Context ctx;
+    char path[PATH_MAX], hex[33];
+    FILE *f;
+    int r;
+
+    chunk_path(path, sizeof (path), dir, digest);
+    if (!(f = fopen(path, "rb"))) {
+        printf("Chunk %s missing from store %s!\n", digest, dir);
+        return 0;
+    }
+    r = fread(buf, len, 1, f) && fgetc(f) == EOF;
+    fclose(f);
+    stats_end(STATS_FILE, t, len);
+    if (!r) {
+        printf("Chunk %s has the wrong size!\n", path);
+        return 0;
+    }
+
+    t = stats_begin();
+    ul_MD5Init(&ctx);
+    ul_MD5Update(&ctx, buf, len);
+    md5_hex(&ctx, hex);
+    stats_end(STATS_HASH, t, len);
+    if (strcmp(hex, digest)) {
+        printf("Chunk %s is corrupt, its data hashes to %s!\n", path, hex);
+        return 0;
+    }
+    return 1;
+}
+
+int store_save(const char *dir, const char *manifest, const char *chip, const void *image, uint64_t len,
+               uint32_t block, char *md5, struct store_stats_t *st)
+{
+    struct UL_MD5Context image_ctx, ctx;
+    const uint8_t *p = image;
+    uint32_t blocks = len / block;
+    char (*digests)[33];
+    FILE *f;
+    int ok = 1;
+
+    memset(st, 0, sizeof (*st));
+    if (!block || len % block) {
+        printf("Image of %llu bytes isn't made of %u byte blocks!\n", (unsigned long long)len, block);
+        return 0;
+    }
+    if (!dir_make(dir) || !(digests = malloc(blocks * sizeof (*digests)))) {
+        return 0;
+    }
+
+    ul_MD5Init(&image_ctx);
+    for (uint32_t b = 0; ok && b < blocks; b++, p += block) {
+        uint64_t t = stats_begin();
+        ul_MD5Init(&ctx);                               // Both digests while the block is in cache
+        ul_MD5Update(&ctx, p, block);
+        ul_MD5Update(&image_ctx, p, block);
+        md5_hex(&ctx, digests[b]);
+        stats_end(STATS_HASH, t, block);
+
+        int r = chunk_put(dir, digests[b], p, block);
+        st->new_blocks += (r == 1);
+        st->new_bytes += (r == 1) ? block : 0;
+        ok = (r != 0);
+    }
+    st->blocks = blocks;
+    md5_hex(&image_ctx, md5);
+
+    if (ok) {
+        uint64_t t = stats_begin();
+        if (!(f = fopen(manifest, "w"))) {
+            printf("Unable to write file %s!\n", manifest);
+            ok = 0;
+        } else {
+            fprintf(f, "%s\nchip %s\nsize %llu\nblock %u\nmd5 %s\n", STORE_MAGIC, chip, (unsigned long long)len,
+                    block, md5);
+            for (uint32_t b = 0; b < blocks; b++) {
+                fprintf(f, "%s\n", digests[b]);
+            }
+            if (fclose(f)) {
+                printf("Unable to write file %s!\n", manifest);
+                ok = 0;
+            }
+        }
+        stats_end(STATS_FILE, t, 0);
+    }
+    free(digests);
+    return ok;
+}
+
+// Manifest read up to the block digests, NULL if it isn't one
+static FILE * manifest_open(const char *manifest, uint64_t *size, uint32_t *block, char *md5)
+{
+    char line[256], chip[128];
+    unsigned long long sz = 0;
+    unsigned bs = 0;
+    FILE *f;
+
+    if (!(f = fopen(manifest, "r"))) {
+        printf("Unable to read from file %s!\n", manifest);
+        return NULL;
+    }
+    if (!fgets(line, sizeof (line), f) || strncmp(line, STORE_MAGIC, strlen(STORE_MAGIC))
+        || !fgets(line, sizeof (line), f) || sscanf(line, "chip %127s", chip) != 1
+        || !fgets(line, sizeof (line), f) || sscanf(line, "size %llu", &sz) != 1
+        || !fgets(line, sizeof (line), f) || sscanf(line, "block %u", &bs) != 1
+        || !fgets(line, sizeof (line), f) || sscanf(line, "md5 %32[0-9a-f]", md5) != 1
+        || !bs || sz % bs) {
+        printf("%s is not a dsoflash manifest!\n", manifest);
+        fclose(f);
+        return NULL;
+    }
+    *size = sz;
+    *block = bs;
+    return f;
+}
+
+int store_manifest(const char *manifest, uint64_t *len, char *md5)
+{
+    uint32_t block;
+    FILE *f = manifest_open(manifest, len, &block, md5);
+
+    if (!f) {
+        return 0;
+    }
+    fclose(f);
+    return 1;
+}
+
+void * store_load(const char *dir, const char *manifest, uint64_t *len, char *md5)
+{
+    char line[256], image_md5[33];
+    uint64_t size, off = 0;
+    uint32_t block;
+    uint8_t *buf;
+    FILE *f;
+
+    if (!(f = manifest_open(manifest, &size, &block, image_md5))) {
+        return NULL;
+    }
+    if (size != (size_t)size || !(buf = malloc(size ? size : 1))) {
+        printf("Unable to allocate %llu bytes for %s!\n", (unsigned long long)size, manifest);
+        fclose(f);
+        return NULL;
+    }
+
+    while (off < size && fgets(line, sizeof (line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!digest_valid(line) || !chunk_get(dir, line, buf + off, block)) {
+            break;
+        }
+        off += block;
+    }
+    fclose(f);
+    if (off != size) {
+        printf("Manifest %s is incomplete or names a bad chunk!\n", manifest);
+        free(buf);
+        return NULL;
+    }
+    if (len) {
+        *len = size;
+    }
+    if (md5) {
+        strcpy(md5, image_md5);
+    }
+    return buf;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <stdint.h>
+
+/*
+ * Content addressed backups: an image is cut in erase blocks, each kept
+ * once as <dir>/<xx>/<md5> however many images (or places in one) hold it,
+ * and the image itself becomes a small text manifest:
+ *
+ *   dsoflash-manifest 1
+ *   chip <name>
+ *   size <bytes>
+ *   block <bytes>
+ *   md5 <md5 of the whole image>
+ *   <md5 of block 0>
+ *   ...
+ *
+ * Chunks are written aside and renamed into place, so several stations can
+ * share a store and a crash never leaves a torn chunk under a digest.
+ */
+struct store_stats_t {
+    uint32_t blocks;
+    uint32_t new_blocks;        // Not in the store before
+    uint64_t new_bytes;
+};
+
+// Store image, len a multiple of block, and write its manifest; md5 gets the image digest
+int store_save(const char *dir, const char *manifest, const char *chip, const void *image, uint64_t len,
+               uint32_t block, char *md5, struct store_stats_t *st);
+
+/*
+ * Image of a manifest, malloc()ed. Every chunk is checked against its
+ * digest as it is read, md5 (if not NULL) gets the one the manifest
+ * recorded for the whole image instead of hashing it again.
+ */
+void * store_load(const char *dir, const char *manifest, uint64_t *len, char *md5);
+// Size and md5 of the image a manifest records, without loading it
+int store_manifest(const char *manifest, uint64_t *len, char *md5);
+
+#endif // STORE_H_
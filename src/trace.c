@@ -0,0 +1,456 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "trace.h"
+#include "stats.h"
+#include "f1c100s_f1c200s_f1c500s.h"
+#include "md5.h"
+
+#define TRACE_HS_REG        (0x01c13040U)               // Written by init_system() to switch USB to HS mode
+#define TRACE_PHASES_MAX    (32U)
+#define TRACE_KEEP_SWAPBUF  (512U)                      // Shorter writes to the swap buffer are command arguments, not pages
+
+enum {
+    FEL_REQ_VERSION         = 0x001,
+    FEL_REQ_WRITE           = 0x101,
+    FEL_REQ_EXEC            = 0x102,
+    FEL_REQ_READ            = 0x103,
+};
+
+enum { STEP_IDLE, STEP_DATA, STEP_STATUS };
+
+static struct {
+    FILE *f;
+    int md5;
+    uint64_t t0;
+
+    uint32_t stage_left;                        // Bytes left of the data stage announced by AWUC
+    int stage_done;                             // Data stage complete, AWUS pending
+    uint8_t stage[16];                          // Start of the data stage, holds FEL requests
+    uint32_t stage_got;
+
+    int step;
+    uint32_t req, addr, len;
+    uint64_t start;
+    struct UL_MD5Context md5ctx;
+    int keep;                                   // Write data goes to the trace
+    uint8_t *data;
+    uint32_t data_len, data_cap;
+} tr;
+
+int __real_libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+                                unsigned char *data, int length, int *transferred, unsigned int timeout);
+int __wrap_libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+                                unsigned char *data, int length, int *transferred, unsigned int timeout);
+
+
+__attribute__((weak)) uint64_t trace_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000U + ts.tv_nsec;
+}
+
+static uint64_t trace_us(uint64_t ns)
+{
+    return (ns - tr.t0) / 1000;
+}
+
+static void md5_hex(struct UL_MD5Context *ctx, char *hex)
+{
+    unsigned char d[UL_MD5LENGTH];
+
+    ul_MD5Final(d, ctx);
+    for (int i = 0; i < UL_MD5LENGTH; i++) {
+        sprintf(&hex[2*i], "%02x", d[i]);
+    }
+}
+
+int trace_open(const char *path, int md5)
+{
+    if (!(tr.f = fopen(path, "w"))) {
+        printf("Unable to open trace file %s!\n", path);
+        return 0;
+    }
+    tr.md5 = md5;
+    tr.t0 = trace_clock_ns();
+    fprintf(tr.f, "# dsoflash trace v1\n");
+    atexit(trace_close);
+    return 1;
+}
+
+void trace_close(void)
+{
+    if (tr.f) {
+        fclose(tr.f);
+        tr.f = NULL;
+    }
+    free(tr.data);
+    tr.data = NULL;
+    tr.data_cap = 0;
+}
+
+void trace_phase(const char *name)
+{
+    stats_phase(name);
+    if (tr.f) {
+        fprintf(tr.f, "P %" PRIu64 " %s\n", trace_us(trace_clock_ns()), name);
+    }
+}
+
+static void op_begin(void)
+{
+    tr.req = tr.stage[0] | tr.stage[1] << 8;
+    tr.addr = tr.stage[4] | tr.stage[5] << 8 | tr.stage[6] << 16 | (uint32_t)tr.stage[7] << 24;
+    tr.len = tr.stage[8] | tr.stage[9] << 8 | tr.stage[10] << 16 | (uint32_t)tr.stage[11] << 24;
+    tr.step = (tr.req == FEL_REQ_EXEC) ? STEP_STATUS : STEP_DATA;
+    tr.keep = tr.f && (tr.req == FEL_REQ_WRITE) && (tr.addr < F1C100S_SWAPBUF || tr.len < TRACE_KEEP_SWAPBUF);
+    tr.data_len = 0;
+    ul_MD5Init(&tr.md5ctx);
+
+    if (tr.keep && tr.len > tr.data_cap) {
+        uint8_t *tmp = realloc(tr.data, tr.len);
+        if (!tmp) {
+            tr.keep = 0;
+        } else {
+            tr.data = tmp;
+            tr.data_cap = tr.len;
+        }
+    }
+}
+
+static void op_data(const uint8_t *buf, uint32_t len)
+{
+    if (tr.step != STEP_DATA) {
+        return;
+    }
+    if (tr.f && tr.md5) {
+        ul_MD5Update(&tr.md5ctx, buf, len);
+    }
+    if (tr.keep) {
+        memcpy(&tr.data[tr.data_len], buf, len);
+        tr.data_len += len;
+    }
+}
+
+static void op_end(uint64_t now)
+{
+    uint64_t t = trace_us(tr.start), dur = (now - tr.start) / 1000;
+    char hex[2*UL_MD5LENGTH + 1] = "-";
+
+    if (tr.req == FEL_REQ_WRITE) {
+        stats_add(STATS_USB_OUT, now - tr.start, tr.len);
+    } else if (tr.req == FEL_REQ_READ) {
+        stats_add(STATS_USB_IN, now - tr.start, tr.len);
+    } else if (tr.req == FEL_REQ_EXEC) {
+        stats_add(STATS_EXEC, now - tr.start, 0);
+    }
+    if (!tr.f) {
+        return;
+    }
+    if (tr.md5 && tr.req != FEL_REQ_EXEC) {
+        md5_hex(&tr.md5ctx, hex);
+    }
+    switch (tr.req) {
+    case FEL_REQ_VERSION:
+        fprintf(tr.f, "V %" PRIu64 " %" PRIu64 "\n", t, dur);
+        break;
+    case FEL_REQ_WRITE:
+        fprintf(tr.f, "W %" PRIu64 " %" PRIu64 " %08x %u %s", t, dur, tr.addr, tr.len, hex);
+        if (tr.keep) {
+            fputc(' ', tr.f);
+            for (uint32_t i = 0; i < tr.data_len; i++) {
+                fprintf(tr.f, "%02x", tr.data[i]);
+            }
+        }
+        fputc('\n', tr.f);
+        break;
+    case FEL_REQ_READ:
+        fprintf(tr.f, "R %" PRIu64 " %" PRIu64 " %08x %u %s\n", t, dur, tr.addr, tr.len, hex);
+        break;
+    case FEL_REQ_EXEC:
+        fprintf(tr.f, "X %" PRIu64 " %" PRIu64 " %08x\n", t, dur, tr.addr);
+        break;
+    default:
+        fprintf(tr.f, "# unknown FEL request 0x%03x\n", tr.req);
+        break;
+    }
+}
+
+/*
+ * Every FEL call is three AWUC/AWUS framed stages (request, data, status),
+ * exec has no data stage. Transfers only count with the bytes they moved,
+ * so retries of a NAKed status request fall out.
+ */
+static void trace_transfer(const uint8_t *buf, uint32_t n, int in, uint64_t before, uint64_t after)
+{
+    if (tr.stage_left) {
+        uint32_t take = (n < tr.stage_left) ? n : tr.stage_left;
+        if (tr.stage_got < sizeof (tr.stage)) {
+            uint32_t c = sizeof (tr.stage) - tr.stage_got;
+            memcpy(&tr.stage[tr.stage_got], buf, (take < c) ? take : c);
+        }
+        tr.stage_got += take;
+        op_data(buf, take);
+        tr.stage_left -= take;
+        tr.stage_done = !tr.stage_left;
+        return;
+    }
+
+    if (!in && n == 32 && !memcmp(buf, "AWUC", 4)) {
+        tr.stage_left = buf[8] | buf[9] << 8 | buf[10] << 16 | (uint32_t)buf[11] << 24;
+        tr.stage_got = 0;
+        if (tr.step == STEP_IDLE) {
+            tr.start = before;
+        }
+    } else if (in && n == 13 && !memcmp(buf, "AWUS", 4) && tr.stage_done) {
+        tr.stage_done = 0;
+        if (tr.step == STEP_IDLE) {
+            if (tr.stage_got == sizeof (tr.stage)) {
+                op_begin();
+            }
+        } else if (tr.step == STEP_DATA) {
+            tr.step = STEP_STATUS;
+        } else {
+            op_end(after);
+            tr.step = STEP_IDLE;
+        }
+    }
+}
+
+int __wrap_libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+                                unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+    uint64_t before;
+    int r;
+
+    if (!tr.f && !stats_enabled()) {
+        return __real_libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+    }
+    before = trace_clock_ns();
+    r = __real_libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+    if (transferred && *transferred > 0) {
+        trace_transfer(data, *transferred, endpoint & LIBUSB_ENDPOINT_IN, before, trace_clock_ns());
+    }
+    return r;
+}
+
+
+struct trace_phase_t {
+    char name[32];
+    uint32_t ops;
+    uint64_t out, in;
+    uint64_t trace_us;
+    uint64_t replay_ns;
+};
+
+static struct trace_phase_t * phase_get(struct trace_phase_t *phases, uint32_t *n, const char *name)
+{
+    for (uint32_t i = 0; i < *n; i++) {
+        if (!strcmp(phases[i].name, name)) {
+            return &phases[i];
+        }
+    }
+    if (*n == TRACE_PHASES_MAX) {
+        return &phases[*n - 1];
+    }
+    memset(&phases[*n], 0, sizeof (phases[*n]));
+    snprintf(phases[*n].name, sizeof (phases[*n].name), "%s", name);
+    return &phases[(*n)++];
+}
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static int hex_decode(const char *hex, uint8_t *buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        int hi = hex_nibble(hex[2*i]), lo = (hi < 0) ? -1 : hex_nibble(hex[2*i + 1]);
+        if (lo < 0) {
+            return 0;
+        }
+        buf[i] = hi << 4 | lo;
+    }
+    return 1;
+}
+
+// Name of the first phase changing the flash, NULL if the trace only reads it
+static const char * trace_destructive(FILE *f)
+{
+    static const char *const destructive[] = { "erase", "write" };
+    const char *found = NULL;
+    char line[128], name[32];
+    uint64_t t;
+
+    while (!found && fgets(line, sizeof (line), f)) {
+        if (sscanf(line, "P %" SCNu64 " %31s", &t, name) != 2) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof (destructive) / sizeof (destructive[0]); i++) {
+            if (!strcmp(name, destructive[i])) {
+                found = destructive[i];
+            }
+        }
+    }
+    rewind(f);
+    return found;
+}
+
+int trace_replay(struct xfel_ctx_t *ctx, const char *path, int destructive,
+                 int (*reconnect)(void *user), void *user)
+{
+    struct trace_phase_t phases[TRACE_PHASES_MAX], *ph, total = { .name = "total" };
+    uint32_t nphases = 0, mismatches = 0, lineno = 0;
+    uint8_t *buf = NULL;
+    uint32_t buf_cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    const char *harm;
+    int ret = 0;
+    FILE *f;
+
+    if (!(f = fopen(path, "r"))) {
+        printf("Unable to open trace file %s!\n", path);
+        return 0;
+    }
+    if (!destructive && (harm = trace_destructive(f))) {
+        printf("Trace %s has a%s %s phase, replaying it changes the flash! Add --destructive to do so.\n",
+               path, (harm[0] == 'e') ? "n" : "", harm);
+        fclose(f);
+        return 0;
+    }
+    ph = phase_get(phases, &nphases, "init");
+
+    printf("Replaying %s...\n", path);
+    while (getline(&line, &line_cap, f) > 0) {
+        char op, md5[2*UL_MD5LENGTH + 1], name[32];
+        uint64_t t, dur, t0;
+        uint32_t addr = 0, len = 0;
+        int pos = 0;
+
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (line[0] == 'P') {
+            if (sscanf(line, "P %" SCNu64 " %31s", &t, name) != 2) {
+                goto BAD_LINE;
+            }
+            ph = phase_get(phases, &nphases, name);
+            continue;
+        }
+        if (sscanf(line, "%c %" SCNu64 " %" SCNu64 " %n", &op, &t, &dur, &pos) != 3) {
+            goto BAD_LINE;
+        }
+        if (op == 'W' || op == 'R') {
+            int pos2 = 0;
+            if (sscanf(&line[pos], "%x %u %32s %n", &addr, &len, md5, &pos2) != 3) {
+                goto BAD_LINE;
+            }
+            pos += pos2;
+            if (len > buf_cap) {
+                uint8_t *tmp = realloc(buf, len);
+                if (!tmp) {
+                    printf("Unable to allocate replay buffer!\n");
+                    goto CLEANUP;
+                }
+                buf = tmp;
+                buf_cap = len;
+            }
+        } else if (op == 'X') {
+            if (sscanf(&line[pos], "%x", &addr) != 1) {
+                goto BAD_LINE;
+            }
+        } else if (op != 'V') {
+            goto BAD_LINE;
+        }
+
+        t0 = trace_clock_ns();
+        switch (op) {
+        case 'V':                                                       // fel_init() of the replay did it
+            continue;
+        case 'W':
+            if (line[pos] != '\n' && line[pos] != '\0') {
+                if (!hex_decode(&line[pos], buf, len)) {
+                    goto BAD_LINE;
+                }
+            } else {
+                memset(buf, 0xFF, len);                                 // Page data was not kept
+            }
+            if (addr == TRACE_HS_REG && len == 4) {
+                if (!reconnect(user)) {
+                    goto CLEANUP;
+                }
+            } else {
+                fel_write(ctx, addr, buf, len);
+            }
+            ph->out += len;
+            break;
+        case 'R':
+            fel_read(ctx, addr, buf, len);
+            if (md5[0] != '-') {
+                struct UL_MD5Context c;
+                char hex[2*UL_MD5LENGTH + 1];
+                ul_MD5Init(&c);
+                ul_MD5Update(&c, buf, len);
+                md5_hex(&c, hex);
+                mismatches += !!strcmp(hex, md5);
+            }
+            ph->in += len;
+            break;
+        case 'X':
+            if (addr == 0x00008800) {                                   // SPI payload, may run for long
+                if (!f1c100s_spi_exec_wait(ctx, dur/1000*2 + 10000)) {
+                    goto CLEANUP;
+                }
+            } else {
+                fel_exec(ctx, addr);
+            }
+            break;
+        }
+        ph->replay_ns += trace_clock_ns() - t0;
+        ph->trace_us += dur;
+        ph->ops++;
+        continue;
+
+    BAD_LINE:
+        printf("Malformed trace line %u!\n", lineno);
+        goto CLEANUP;
+    }
+
+    printf("\n%-16s %8s %10s %10s %10s %10s\n", "Phase", "Ops", "MB out", "MB in", "Trace s", "Replay s");
+    for (uint32_t i = 0; i < nphases; i++) {
+        ph = &phases[i];
+        printf("%-16s %8u %10.2f %10.2f %10.3f %10.3f\n", ph->name, ph->ops,
+               ph->out / 1e6, ph->in / 1e6, ph->trace_us / 1e6, ph->replay_ns / 1e9);
+        total.ops += ph->ops;
+        total.out += ph->out;
+        total.in += ph->in;
+        total.trace_us += ph->trace_us;
+        total.replay_ns += ph->replay_ns;
+    }
+    printf("%-16s %8u %10.2f %10.2f %10.3f %10.3f\n", total.name, total.ops,
+           total.out / 1e6, total.in / 1e6, total.trace_us / 1e6, total.replay_ns / 1e9);
+    if (mismatches) {
+        printf("\n%u reads returned other data than recorded\n", mismatches);
+    }
+    ret = 1;
+
+CLEANUP:
+    free(line);
+    free(buf);
+    fclose(f);
+    return ret;
+}
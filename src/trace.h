@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <fel.h>
+
+/*
+ * USB/FEL transaction traces.
+ *
+ * Every libusb_bulk_transfer() goes through the trace (the binary is linked
+ * with --wrap=libusb_bulk_transfer), which decodes the AWUC/FEL framing back
+ * into fel_write/fel_read/fel_exec calls. One line per call:
+ *
+ *   P <t_us> <phase>
+ *   V <t_us> <dur_us>
+ *   W <t_us> <dur_us> <addr> <len> <md5|-> [<hex data>]
+ *   R <t_us> <dur_us> <addr> <len> <md5|->
+ *   X <t_us> <dur_us> <addr>
+ *
+ * Data of writes is kept except for page data in the swap buffer, md5 of
+ * payloads only with trace_open(path, 1).
+ */
+int trace_open(const char *path, int md5);
+void trace_close(void);
+void trace_phase(const char *name);              // Also starts a phase of the stats
+
+// Monotonic time for timestamps, the emulator replaces it with its own clock
+uint64_t trace_clock_ns(void);
+
+/*
+ * Runs a trace against ctx and prints the time per phase next to the
+ * recorded one. Writes of kept data are replayed as is, the others as 0xFF.
+ * The write switching USB to HS mode is left to reconnect().
+ *
+ * A trace with an erase or write phase erases and programs the flash again
+ * when replayed, it is refused unless destructive is set.
+ */
+int trace_replay(struct xfel_ctx_t *ctx, const char *path, int destructive,
+                 int (*reconnect)(void *user), void *user);
+
+#endif // TRACE_H_
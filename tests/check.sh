@@ -0,0 +1,75 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+# Copyright 2024      Jorenar
+#
+# Round trips of dsoflash-emu on a single and a multi die chip, run by `make check`:
+#   tests/check.sh <dsoflash-emu> <work dir>
+# Every run has to succeed without protocol violations and every image read
+# back has to match, by content and by the md5 dsoflash reports.
+
+EMU=$1
+WORK=$2
+CHIPS="W25N01GV W25M02GV"
+
+[ -x "$EMU" ] && [ -n "$WORK" ] || { echo "usage: $0 <dsoflash-emu> <work dir>"; exit 2; }
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+# run <what> <dsoflash args...>, the log is kept in $WORK/<what>.log
+run()
+{
+    what=$1
+    shift
+    "$EMU" "$@" > "$WORK/$what.log" 2>&1 || fail "$what (exit $?), see $WORK/$what.log"
+    grep -q "^emu: .* 0 violations$" "$WORK/$what.log" || fail "$what violated the NAND protocol, see $WORK/$what.log"
+    echo "ok: $what"
+}
+
+# same <file> <image>, content and the .md5 written next to file
+same()
+{
+    cmp -s "$1" "$2" || fail "$1 differs from $2"
+    [ "$(tr -d '\0\n' < "${1%.*}.md5")" = "$(md5sum < "$2" | cut -c1-32)" ] || fail "${1%.*}.md5 isn't the md5 of $2"
+}
+
+rm -rf "$WORK"
+mkdir -p "$WORK" || exit 2
+export DSOFLASH_EMU_CHIP DSOFLASH_EMU_FLASH
+
+for chip in $CHIPS; do
+    DSOFLASH_EMU_CHIP=$chip
+    DSOFLASH_EMU_FLASH=$WORK/$chip.raw
+    img=$WORK/$chip.bin
+
+    run "$chip-detect" detect
+    size=$(sed -n "s/^Flash found: .* Size: \([0-9]*\) MB$/\1/p" "$WORK/$chip-detect.log")
+    [ -n "$size" ] || fail "$chip not detected"
+
+    # First half data, second half erased, so --sparse-read has pages to skip
+    { head -c $((size * 512 * 1024)) /dev/urandom
+      head -c $((size * 512 * 1024)) /dev/zero | tr '\0' '\377'; } > "$img"
+    md5sum < "$img" | cut -c1-32 > "$WORK/$chip.md5"    # write checks it
+
+    run "$chip-erase"       erase
+    run "$chip-write"       write "$img"
+    run "$chip-read"        read "$WORK/$chip-read.bin"
+    same "$WORK/$chip-read.bin" "$img"
+    run "$chip-verify"      verify "$img"
+    run "$chip-health"      health
+    run "$chip-sparse-read" --sparse-read read "$WORK/$chip-sparse.bin"
+    same "$WORK/$chip-sparse.bin" "$img"
+
+    run "$chip-store-read"   --store "$WORK/store" read "$WORK/$chip-store"
+    run "$chip-store-verify" --store "$WORK/store" verify "$WORK/$chip-store.manifest"
+    run "$chip-erase-again"  erase
+    run "$chip-store-write"  --store "$WORK/store" write "$WORK/$chip-store.manifest"
+    run "$chip-read-again"   read "$WORK/$chip-again.bin"
+    same "$WORK/$chip-again.bin" "$img"
+    rm -f "$WORK/$chip"*.bin "$WORK/$chip.raw"         # Only kept for a look at a failure
+done
+
+echo "All checks passed"